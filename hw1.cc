@@ -1,36 +1,152 @@
 #include <omp.h>
 #include <pthread.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <boost/functional/hash.hpp>
+#include <chrono>
+#include <climits>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
+#include <deque>
+#include <filesystem>
 #include <fstream>
+#include <functional>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <queue>
+#include <random>
+#include <sstream>
+#include <thread>
 #include <unordered_map>
+#if PROFILE && defined(__x86_64__)
+#include <x86intrin.h>
+#endif
 #include <unordered_set>
 #include <utility>
 #include <vector>
 
-#include "tbb/concurrent_priority_queue.h"
-#include "tbb/concurrent_queue.h"
 #include "tbb/concurrent_unordered_map.h"
-#include "tbb/concurrent_vector.h"
 using namespace std;
 using namespace tbb;
 
 // =================Definition================
+#ifndef MAX_BOXES
+#define MAX_BOXES 32
+#endif
+static_assert(MAX_BOXES <= 64, "targets are tracked in 64-bit masks");
+#ifndef ZOBRIST_SEED
+#define ZOBRIST_SEED 0x9e3779b97f4a7c15ULL
+#endif
+#ifndef PROFILE
+#define PROFILE 0
+#endif
 typedef unordered_set<pair<int, int>, boost::hash<pair<int, int>>> Pos_Set;
 typedef pair<int, int> Position;
 typedef bitset<256> bs256;
+typedef uint32_t StateIdx;
+const StateIdx NO_PARENT = UINT32_MAX;
+const int DIST_INF = 1 << 14;
+const int LEARN_BOXES = 3;        // largest box cluster the learned rule tries to prove dead
+const size_t LEARN_NODES = 512;   // sub-search states per region before a cluster counts as alive
+const size_t GROW_FRONTIER = 256;  // queued states per worker before a budgeted solve asks for one more
 
-int Rows, Cols;
-vector<Position> Targets;
-string initMap;
-array<array<int, 256>, 256> to1DArray;
-array<int, 256> zobrist;
-map<pair<int, int>, vector<set<Position>>> deadPointsArray;
-bs256 deadMap;
+/*
+ * Part of the map behind a single entrance cell that holds targets but starts
+ * without boxes or the player. Boxes crossing the entrance are driven straight
+ * to the next free target of fillOrder, an order in which every target can
+ * still be reached with the earlier ones filled.
+ */
+struct GoalRoom {
+    size_t entrance;
+    bs256 cells;
+    int fills;  // targets in fillOrder
+    array<uint8_t, MAX_BOXES> fillOrder;
+};
+/*
+ * Static analysis of one level, everything derived from its map that costs
+ * more than parsing it. Plain data without pointers, so --cache can keep it in
+ * a file that later runs of the same map use in place, mapped read-only.
+ */
+struct LevelTables {
+    array<array<int, 256>, MAX_BOXES> pushDist;  // pushes from each cell to each target
+    array<int, 256> nearestDist;
+    array<uint64_t, 256> targetMask;
+    bs256 deadMap;
+    array<bs256, 4> deadPairs;  // cells whose dead pattern partner is the next cell in each Direction
+    array<bs256, 4> tunnelMap;
+    int goalRoomCount;
+    array<GoalRoom, MAX_BOXES> goalRooms;
+    array<int, 256> roomOf;
+    int symmetryCount;
+    array<array<uint8_t, 256>, 7> symmetries;  // cell maps of the board's rotations and mirrors other than the identity
+};
+static_assert(is_trivially_copyable<LevelTables>::value, "level tables are cached as raw bytes");
+/*
+ * Leads a cached LevelTables file. The tables only fit the build that wrote
+ * them and the exact map they came from, both checked before they are used.
+ */
+struct alignas(64) TablesHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t size;  // sizeof(LevelTables), differs with MAX_BOXES
+    int32_t rows, cols;
+    char map[256];  // padded rows with boxes and player, zero filled
+};
+const char TABLES_MAGIC[8] = {'S', 'O', 'K', 'O', 'T', 'B', 'L', '\0'};
+const uint32_t TABLES_VERSION = 1;  // bump on any change to the analysis or LevelTables, old files are trusted otherwise
+/*
+ * Read-only mapping of a whole file, released with its owner or the next map().
+ */
+class MappedFile {
+   public:
+    MappedFile() = default;
+    ~MappedFile() { unmap(); }
+    MappedFile(MappedFile const&) = delete;
+    MappedFile& operator=(MappedFile const&) = delete;
+    bool map(string const& path);
+    void unmap();
+    char const* data() const { return addr; }
+    size_t size() const { return length; }
+
+   private:
+    char const* addr = nullptr;
+    size_t length = 0;
+};
+/*
+ * Everything derived from one level's map. Each Sokoban owns one and points
+ * ctx at it on every thread that works for it, so levels can be loaded one
+ * after another, or side by side, in the same process.
+ */
+struct LevelContext {
+    int Rows = 0, Cols = 0, Boxes = 0;
+    vector<Position> Targets;
+    string initMap;
+    bs256 wallMap;
+    bs256 startBoxMap;
+    array<array<int, 256>, 256> to1DArray;
+    array<array<uint8_t, 4>, 256> neighbor;  // cell one step in each Direction, itself off the map
+    array<uint8_t, 256> tiles;               // TileFlag bits of every cell
+    array<uint64_t, 256> zobrist;
+    array<uint64_t, 256> zobristPly;
+    array<bs256, 4> edgeMap;  // cells whose next cell in each Direction is off the map
+    bs256 targetMap;
+    LevelTables const* tables = nullptr;  // built or cachedTables, whichever load() used
+    unique_ptr<LevelTables> builtTables;
+    MappedFile cachedTables;
+    bool symmetric = false;  // states are keyed by their canonical orientation
+    concurrent_unordered_map<bs256, bool> learned;  // box clusters proven dead (true) or not (false)
+};
+thread_local LevelContext* ctx = nullptr;
 const vector<vector<string>> deadMasks = {
     {
         " ## ",
@@ -67,6 +183,107 @@ enum MatrixCode : char {
     PLYF = '!',
     NONE = '\0'
 };
+enum Order : int {
+    FILLED = 0,
+    ASTAR = 1,
+    BEST = 2,
+};
+enum Search : int {
+    PARALLEL = 0,
+    SERIAL = 1,
+    BIDIR = 2,
+    EXTERNAL = 3,
+    IDA = 4,
+    PORTFOLIO = 5,
+    ANYTIME = 6,
+    LAYERED = 7,
+};
+enum Matching : int {
+    GREEDY = 0,
+    HUNGARIAN = 1,
+};
+enum DeadRule : uint8_t {
+    ALIVE = 0,
+    DEAD_SQUARE = 1,
+    DEAD_BLOCK = 2,
+    DEAD_PATTERN = 3,
+    DEAD_FREEZE = 4,
+    DEAD_BIPARTITE = 5,
+    DEAD_LEARNED = 6,
+    DEAD_RULES = 7,
+};
+const unsigned ALL_RULES = (1u << DEAD_RULES) - 2;
+// Learning pays for its sub-searches on hard levels only, so it is opt-in
+const unsigned DEFAULT_RULES = ALL_RULES & ~(1u << DEAD_LEARNED);
+const char* const deadRuleNames[DEAD_RULES] = {"alive", "square", "block", "pattern", "freeze", "bipartite", "learned"};
+enum Macro : unsigned {
+    MACRO_TUNNEL = 1,
+    MACRO_ROOM = 2,
+};
+const unsigned ALL_MACROS = MACRO_TUNNEL | MACRO_ROOM;
+enum Phase : int {
+    PHASE_EXPAND = 0,
+    PHASE_FLOOD = 1,
+    PHASE_DEADLOCK = 2,
+    PHASE_PATTERN = 3,
+    PHASE_HEURISTIC = 4,
+    PHASE_MACRO = 5,
+    PHASE_VISITED = 6,
+    PHASE_QUEUE = 7,
+    PHASES = 8,
+};
+const char* const phaseNames[PHASES] = {"expand", "flood", "deadlock", "pattern", "heuristic", "macro", "visited", "queue_wait"};
+enum Counter : int {
+    COUNT_PROBES = 0,
+    COUNT_CAS_RETRIES = 1,
+    COUNT_QUEUE_LOCKS = 2,
+    COUNT_QUEUE_CONTENDED = 3,
+    COUNT_STEALS = 4,
+    COUNTERS = 5,
+};
+const char* const counterNames[COUNTERS] = {"visited_probes", "cas_retries", "queue_locks", "queue_contended", "steals"};
+/*
+ * Per-thread instrumentation, compiled in with -DPROFILE=1 only. Phases are
+ * inclusive: expand covers flood, deadlock, heuristic and macro time spent
+ * inside it. Every thread that records anything gets a Profile that lives
+ * until exit, when dumpProfile() writes the summary to stderr or a JSON file.
+ */
+struct Profile {
+    array<uint64_t, PHASES> cycles{};
+    array<uint64_t, PHASES> calls{};
+    array<uint64_t, COUNTERS> counts{};
+};
+Profile& profile();
+void dumpProfile();
+uint64_t cycleCount();
+class ScopedTimer {
+   public:
+    ScopedTimer(Phase const& phase) : phase(phase), start(cycleCount()) {}
+    ~ScopedTimer() {
+        Profile& p = profile();
+        p.cycles[phase] += cycleCount() - start;
+        p.calls[phase]++;
+    }
+
+   private:
+    Phase phase;
+    uint64_t start;
+};
+#if PROFILE
+#define PROFILE_CONCAT(a, b) a##b
+#define PROFILE_NAME(line) PROFILE_CONCAT(scopedTimer, line)
+#define PROFILE_SCOPE(phase) ScopedTimer PROFILE_NAME(__LINE__)(phase)
+#define PROFILE_COUNT(counter, n) (profile().counts[counter] += (n))
+#else
+#define PROFILE_SCOPE(phase)
+#define PROFILE_COUNT(counter, n)
+#endif
+enum TileFlag : uint8_t {
+    TILE_WALL = 1,
+    TILE_TARGET = 2,
+    TILE_FRAGILE = 4,
+    TILE_NOBOX = TILE_WALL | TILE_FRAGILE,
+};
 enum Direction : size_t {
     UP = 0,
     DOWN = 1,
@@ -111,16 +328,8 @@ char rmPly(char c) {
         return NONE;
 }
 size_t opposite(size_t dir) {
-    switch (dir) {
-        case UP:
-            return DOWN;
-        case DOWN:
-            return UP;
-        case LEFT:
-            return RIGHT;
-        default:
-            return LEFT;
-    }
+    // UP/DOWN and LEFT/RIGHT differ in the low bit only
+    return dir ^ 1;
 }
 char toKey(size_t dir) {
     switch (dir) {
@@ -141,58 +350,377 @@ char const& getBlk(Position const& pos);
 char const& getBlk(int const& r, int const& c);
 size_t to1D(Position const& pos);
 size_t to1D(int const& r, int const& c);
+Position to2D(size_t const& idx);
+size_t step(size_t const& cell, size_t const& dir);
+uint8_t tile(size_t const& cell);
+bs256 flood(size_t const& from, bs256 const& free);
+/*
+ * A bs256 seen as its four 64-bit words, low cells first as libstdc++ keeps
+ * them. std::bitset shifts by a run-time count through a generic loop; these
+ * are the plain word operations the batched deadlock rules are made of, which
+ * the compiler is free to vectorize.
+ */
+struct Words {
+    array<uint64_t, 4> w{};
+    Words() {}
+    explicit Words(bs256 const& map) {
+        static_assert(sizeof(bs256) == sizeof(w), "bs256 is four 64-bit words");
+        memcpy(w.data(), &map, sizeof(w));
+    }
+    bool operator[](size_t const& cell) const { return w[cell >> 6] >> (cell & 63) & 1; }
+    Words operator&(Words const& rhs) const {
+        Words res;
+        for (int i = 0; i < 4; i++) res.w[i] = w[i] & rhs.w[i];
+        return res;
+    }
+    Words operator|(Words const& rhs) const {
+        Words res;
+        for (int i = 0; i < 4; i++) res.w[i] = w[i] | rhs.w[i];
+        return res;
+    }
+    Words operator~() const {
+        Words res;
+        for (int i = 0; i < 4; i++) res.w[i] = ~w[i];
+        return res;
+    }
+    bool any() const { return (w[0] | w[1] | w[2] | w[3]) != 0; }
+};
+template <size_t dir, bool offMap>
+Words shifted(Words const& map);
+Words shiftedFar(Words const& map, size_t const& n, bool const& up);
+/*
+ * The square, block and pattern rules for every push out of one box layout at
+ * once. A push moves a box onto a cell next to the one it left and the rest of
+ * the child's layout is the parent's, so each rule becomes a few whole-board
+ * word operations on boxMap shifted towards the neighbours of the destination.
+ * verdict() then picks the boards that do not involve the cell the box left
+ * and agrees with movePly() on every push.
+ */
+struct DeadPushes {
+    Words square;
+    array<Words, 4> block;       // 2x2 squares reaching vertically (v) and horizontally (h): 2 * v + h - LEFT
+    array<Words, STOP> pattern;  // boxes whose pattern partner is the next cell in each Direction
+    DeadPushes(bs256 const& boxMap, unsigned const& deadRules);
+    uint8_t verdict(size_t const& cell, size_t const& dir) const;
+};
+bool deadCluster(bs256 const& cluster);
+uint64_t fnv1a(string const& text);
+vector<pair<uint8_t, uint8_t>> macroPushes(bs256 const& boxMap, size_t box, size_t const& dir, unsigned const& macros);
+/*
+ * Slab allocator that owns every node of a solve. Nodes are addressed by 32-bit
+ * handles (slab number in the high bits, slot in the low SLAB_BITS) and are only
+ * released all at once when the arena is destroyed. Each thread carves nodes out
+ * of its own slab, so the shared counter is touched once per SLAB_SIZE nodes.
+ * clear() forgets every node but keeps the slabs for the next solve.
+ */
+template <typename T>
+class NodeArena {
+   public:
+    NodeArena(int threads = 1);
+    ~NodeArena();
+    NodeArena(NodeArena const&) = delete;
+    NodeArena& operator=(NodeArena const&) = delete;
+    StateIdx push(T const& obj, int tid = 0);
+    void pop(StateIdx const& idx, int tid = 0);
+    void clear();
+    size_t bytes() const;
+    T& operator[](StateIdx const& idx);
+    T const& operator[](StateIdx const& idx) const;
+
+   private:
+    static constexpr int SLAB_BITS = 14;
+    static constexpr StateIdx SLAB_SIZE = 1u << SLAB_BITS;
+    static constexpr StateIdx MAX_SLABS = 1u << (32 - SLAB_BITS);
+    struct alignas(64) Pool {
+        StateIdx next = 0;
+        StateIdx end = 0;
+    };
+    vector<T*> slabs;
+    vector<Pool> pools;
+    atomic<StateIdx> slabCount;
+};
+/*
+ * Threads of one OpenMP team shared by concurrent solves. A thread that runs
+ * out of levels hands itself back; a solve whose frontier keeps growing takes
+ * one and runs an extra search worker as a task on it.
+ */
+class ThreadBudget {
+   public:
+    void release();
+    bool acquire();
+
+   private:
+    atomic<int> idle{0};
+};
 class Sokoban {
    public:
+    class Heuristic;
+    /*
+     * Per-thread scratch handed to State::nextStates(): the heuristic to price
+     * children with (none for FILLED), the enabled DeadRule bits and how many
+     * children each rule pruned.
+     */
+    struct Expansion {
+        Heuristic* heuristic = nullptr;
+        unsigned deadRules = DEFAULT_RULES;
+        unsigned macros = ALL_MACROS;
+        int pushBound = INT_MAX;  // children that cannot finish in fewer pushes are dropped
+        array<size_t, DEAD_RULES> prunes{};
+    };
+    /*
+     * Fixed-size search node. Boxes are kept as sorted 1D indices and the player
+     * is normalized to the top-left most cell of its reachable region, so the
+     * pair (boxes, pos) identifies the state. On a symmetric board a forward state
+     * is keyed by its canonical() orientation instead, so mirrored and rotated
+     * layouts share one visited entry. Moves are not stored: each state
+     * only remembers its parent and the push that produced it, and the full move
+     * string is rebuilt by getMoveSequence() once a solution is found. A macro
+     * state records its first push only; the rest is macroPushes() of the state
+     * right after it, which is deterministic and replayed the same way.
+     */
     class State {
        private:
-        Position pos;
-        bs256 boxMap;
-        bs256 wallMap;
-        string moveSequence;
-        int filled;
-        bool dead;
-        int hashValue;
+        array<uint8_t, MAX_BOXES> boxes;
+        StateIdx parent;
+        uint64_t hashValue;
+        uint8_t pos;
+        uint8_t pushPos;
+        uint8_t pushDir;
+        uint8_t filled;
+        uint8_t dead;
+        uint16_t pushes;
+        uint16_t heuristic;
+        bool backward;
+        bool macro;
+        void moveBox(size_t const& from, size_t const& to);
 
        public:
-        State() : filled(0), dead(false), hashValue(0) {}
+        State() : parent(NO_PARENT), hashValue(0), pos(0), pushPos(0), pushDir(STOP), filled(0), dead(ALIVE), pushes(0), heuristic(0), backward(false), macro(false) {}
         State(Position const& pos, bs256 const& boxMap);
-        State(State const& obj);
-        ~State() {}
-        bool canMovePly(Position const& curpos, int const& dir) const;
-        void movePly(int const& dir);
-        vector<State*> nextStates() const;
+        bool canMovePly(bs256 const& boxMap, size_t const& cur, size_t const& dir) const;
+        void movePly(bs256& boxMap, size_t const& cur, size_t const& dir, unsigned const& deadRules = DEFAULT_RULES);
+        bool isFrozen(bs256 const& boxMap, size_t const& cell, bs256& fixed, bool& offTarget) const;
+        bool matchable() const;
+        vector<State> nextStates(StateIdx const& self, Expansion& expansion) const;
+        void pullPly(bs256& boxMap, size_t const& cur, size_t const& dir);
+        vector<State> prevStates(StateIdx const& self) const;
+        void setBackward();
+        bool isBackward() const;
+        bool isMacro() const;
         bool solved() const;
         bool isDead() const;
-        int const& getFilled() const;
-        bs256 getFloodedMap() const;
-        bs256 const& getBoxMap() const;
-        int const& getHashValue() const;
-        string getMoveSequence() const;
-        Position const& getPos() const;
-        void print() const;
-        State& operator=(const State& rhs);
+        int getFilled() const;
+        int getPushes() const;
+        int getHeuristic() const;
+        void setHeuristic(int const& heuristic);
+        int getCost(Order const& order) const;
+        array<uint8_t, MAX_BOXES> const& getBoxes() const;
+        bs256 getFloodedMap(bs256 const& boxMap) const;
+        bs256 getBoxMap() const;
+        void canonical(array<uint8_t, MAX_BOXES>& boxes, uint8_t& pos) const;
+        uint64_t getKey() const;
+        StateIdx const& getParent() const;
+        Position getPos() const;
+        Position getPushPos() const;
+        size_t getPushDir() const;
+        bool operator==(State const& rhs) const;
     };
     class StateCmp {
        public:
-        bool operator()(State const* const& lhs, State const* const& rhs) {
-            if (lhs->getFilled() < rhs->getFilled())
+        StateCmp(NodeArena<State> const& nodes, Order const& order) : nodes(&nodes), order(order) {}
+        bool operator()(StateIdx const& lhs, StateIdx const& rhs) const {
+            if ((*nodes)[lhs].getCost(order) > (*nodes)[rhs].getCost(order))
                 return true;
-            else if (lhs->getFilled() > rhs->getFilled())
+            else if ((*nodes)[lhs].getCost(order) < (*nodes)[rhs].getCost(order))
                 return false;
             else {
                 return false;
             }
         }
+
+       private:
+        NodeArena<State> const* nodes;
+        Order order;
+    };
+    /*
+     * Lower bound on the pushes left: a box-to-target assignment priced with the
+     * pushDist tables. GREEDY sends every box to its nearest target, HUNGARIAN
+     * solves the assignment exactly. load() prices a parent once, then update()
+     * prices a child in which a single box moved; for HUNGARIAN that is one
+     * re-augmentation of the parent's matching instead of a full O(n^3) solve.
+     */
+    class Heuristic {
+       public:
+        Heuristic(Matching const& matching) : matching(matching) {}
+        int load(State const& state);
+        int update(int const& box, int const& cell);
+
+       private:
+        typedef array<int, MAX_BOXES + 1> Vec;
+        Matching matching;
+        int n;
+        int base;
+        array<int, MAX_BOXES> cells;
+        Vec u, v, p;  // potentials and column -> row matching, 1-based as row 0 is a sentinel
+        Vec cu, cv, cp, minv, way;
+        int cost(int const& row, int const& col) const;
+        void augment(int const& row, Vec& u, Vec& v, Vec& p);
+        int total(Vec const& p) const;
+    };
+    /*
+     * Preallocated open-addressing visited set shared by all search threads.
+     * Each slot packs the upper 32 bits of the Zobrist key of (boxes, pos) with
+     * the arena handle of the stored state, plus one so that zero means empty,
+     * and is claimed with a single CAS. A tag match is verified against the
+     * stored node, so colliding layouts are both kept and counted instead.
+     */
+    class VisitedTable {
+       public:
+        enum Result { INSERTED,
+                      DUPLICATE,
+                      FULL };
+        VisitedTable(size_t bytes, NodeArena<State> const& nodes, atomic<size_t>& collisions);
+        ~VisitedTable();
+        VisitedTable(VisitedTable const&) = delete;
+        VisitedTable& operator=(VisitedTable const&) = delete;
+        Result insert(State const& state, StateIdx const& idx, StateIdx* existing = nullptr);
+        Result insert(State const& state, uint64_t const& key, StateIdx const& idx, StateIdx* existing = nullptr);
+
+       private:
+        atomic<uint64_t>* slots;
+        size_t mask;
+        size_t maxLoad;
+        atomic<size_t> count;
+        NodeArena<State> const* nodes;
+        atomic<size_t>* collisions;
+    };
+    /*
+     * Frontier owned by one search worker: one deque per state cost, so the
+     * StateCmp order is kept locally. The owner serves the cheapest bucket in
+     * FIFO order from the front, idle workers steal from its back so they
+     * rarely meet the owner on the same end. Forward and backward states are
+     * bucketed separately and served in turn, so neither search starves the
+     * other when their costs are not comparable.
+     */
+    class alignas(64) WorkQueue {
+       public:
+        WorkQueue() : best{0, 0}, turn(false) {}
+        void push(StateIdx const& idx, int const& cost, bool const& backward = false);
+        bool pop(StateIdx& idx);
+        bool steal(StateIdx& idx);
+
+       private:
+        mutex lock;
+        array<vector<deque<StateIdx>>, 2> buckets;
+        array<int, 2> best;
+        bool turn;
+        deque<StateIdx>* next();
+        unique_lock<mutex> acquire();
+    };
+    /*
+     * Bounded transposition table for IDA*: two-slot buckets, each slot the
+     * iteration and the pushes the state was entered with, and its full key
+     * xored with those. A state met again in the same iteration with no fewer
+     * pushes has its subtree searched already. A slot torn by two writers fails
+     * the key check and counts as another state. On a miss an empty slot is
+     * taken first, then one of an older iteration, else the one entered
+     * deeper, as the shallow entries cut the larger subtrees.
+     */
+    class TransTable {
+       public:
+        TransTable(size_t bytes);
+        ~TransTable();
+        TransTable(TransTable const&) = delete;
+        TransTable& operator=(TransTable const&) = delete;
+        bool visit(uint64_t const& key, int const& iteration, int const& pushes);
+
+       private:
+        struct Slot {
+            atomic<uint64_t> check;  // key ^ meta
+            atomic<uint64_t> meta;   // iteration + 1 in the high half, pushes in the low one, 0 when empty
+        };
+        Slot* slots;
+        size_t mask;
+    };
+    struct Config {
+        size_t memoryBudget = 2048;  // MB, a quarter of it goes to the visited table, the rest to nodes
+        string spillDir;             // external search files, empty for the system temp directory
+        string learnDir;             // learned deadlocks kept per map across runs, empty to keep none
+        string cacheDir;             // static analysis kept per map across runs, empty to keep none
+        int threads = 0;             // 0 follows OMP_NUM_THREADS
+        Search search = PARALLEL;
+        Order order = FILLED;
+        Matching heuristic = HUNGARIAN;
+        unsigned deadRules = DEFAULT_RULES;
+        unsigned macros = ALL_MACROS;
+        string portfolio = "filled,astar,best,bidir,learned";  // strategies raced by PORTFOLIO
+        atomic<bool> const* cancel = nullptr;                   // stops the search once set elsewhere
+        double timeLimit = 0;                                   // seconds per solve, 0 for none
+        size_t nodeLimit = 0;                                   // expanded states per solve, 0 for none
+        int pushBound = INT_MAX;                                // only solutions with fewer pushes are searched
+    };
+    struct Stats {
+        atomic<size_t> expanded{0};
+        atomic<size_t> generated{0};
+        atomic<size_t> dedupHits{0};
+        atomic<size_t> collisions{0};
+        array<atomic<size_t>, DEAD_RULES> prunes{};
+        Stats& operator+=(Stats const& rhs);
     };
-    Sokoban() {}
+    Sokoban(Config const& config, ThreadBudget* budget = nullptr)
+        : config(config), budget(budget), nodes(config.threads > 0 ? config.threads : omp_get_max_threads()) {}
     ~Sokoban() {}
-    void getInput(char* file_path);
+    bool getInput(char const* file_path);
+    bool load(vector<string> const& lines);
+    string solve();
     string bfs();
-    string parallel_bfs();
+    string parallel_bfs(bool bidirectional = false);
+    string external_bfs();
+    string layered_bfs();
+    string ida();
+    string portfolio();
+    string anytime();
+    Stats const& getStats() const;
+    bool foundSolution() const;
+    bool outOfBudget() const;
 
    private:
     vector<string> input;
+    vector<string> level;  // the rows as given to load()
+    Config config;
+    ThreadBudget* budget;
+    LevelContext context;
+    NodeArena<State> nodes;
+    bool found = false;
+    bool overflow = false;
+    chrono::steady_clock::time_point deadline;  // of the current solve, with config.timeLimit
+    size_t nodeStart = 0;                       // stats.expanded when it began, for config.nodeLimit
+    bool cancelled() const;
+    int countPushes(string const& moves) const;
+    typedef array<uint8_t, MAX_BOXES + 1> Record;  // sorted box cells then the player cell, zero padded
+    static Record pack(State const& state);
+    static State unpack(Record const& rec);
+    struct IdaThread {
+        int bound;
+        int iteration;
+        Expansion expansion;
+        vector<State> path;
+        size_t expanded = 0, generated = 0;
+    };
+    bool idaSearch(IdaThread& thread, TransTable& table, atomic<int>& next, atomic<bool> const& done);
+    StateIdx relink(vector<State> const& path, Expansion& expansion);
+    string learnedPath() const;
+    void buildTables(bs256 const& boxMap, Position const& ply);
+    string tablesPath(string const& mapText) const;
+    bool mapTables(string const& mapText);
+    void saveTables(string const& mapText) const;
+    void saveLearned() const;
+    Position initPly;
     State initState;
+    Stats stats;
+    string getMoveSequence(NodeArena<State> const& nodes, StateIdx idx, StateIdx meetIdx = NO_PARENT) const;
+    vector<State> goalStates() const;
+    string findPath(bs256 const& boxMap, Position const& from, Position const& to) const;
 };
 // =================Implementation==============
 pair<int, int> operator+(pair<int, int> const& lhs, size_t const& rhs) {
@@ -213,426 +741,2644 @@ ostream& operator<<(ostream& os, const pair<int, int>& rhs) {
 }
 
 char const& getBlk(Position const& pos) {
-    return initMap[pos.first * Cols + pos.second];
+    return ctx->initMap[pos.first * ctx->Cols + pos.second];
 }
 char const& getBlk(int const& r, int const& c) {
-    return initMap[r * Cols + c];
+    return ctx->initMap[r * ctx->Cols + c];
 }
 size_t to1D(Position const& pos) {
     return to1D(pos.first, pos.second);
 }
 size_t to1D(int const& r, int const& c) {
-    return to1DArray[r][c];
+    return ctx->to1DArray[r][c];
 }
-
-Sokoban::State::State(Position const& pos, bs256 const& boxMap) : State() {
-    this->pos = pos;
-    this->boxMap = boxMap;
-    for (int r = 0; r < Rows; r++) {
-        for (int c = 0; c < Cols; c++) {
-            if (this->boxMap[to1D(r, c)] && getBlk(r, c) == TARGET) {
-                this->filled++;
-            }
+Position to2D(size_t const& idx) {
+    return make_pair((int)idx / ctx->Cols, (int)idx % ctx->Cols);
+}
+size_t step(size_t const& cell, size_t const& dir) {
+    return ctx->neighbor[cell][dir];
+}
+uint8_t tile(size_t const& cell) {
+    return ctx->tiles[cell];
+}
+// Bit i of the result is bit step(i, dir) of map, offMap where that leaves the map
+template <size_t dir, bool offMap>
+Words shifted(Words const& map) {
+    Words res;
+    const bool up = dir == UP || dir == LEFT;  // towards higher cells: bit i comes from bit i - n
+    size_t n = dir == UP || dir == DOWN ? ctx->Cols : 1;
+    if (n < 64) {
+        for (int i = 0; i < 4; i++) {
+            if (up)
+                res.w[i] = map.w[i] << n | (i > 0 ? map.w[i - 1] >> (64 - n) : 0);
+            else
+                res.w[i] = map.w[i] >> n | (i < 3 ? map.w[i + 1] << (64 - n) : 0);
         }
+    } else {
+        res = shiftedFar(map, n, up);
     }
-
-    for (int r = 0; r < Rows; r++) {
-        for (int c = 0; c < Cols; c++) {
-            if (this->boxMap[to1D(r, c)]) {
-                this->hashValue ^= zobrist[to1D(r, c)];
-            }
-        }
+    Words edge(ctx->edgeMap[dir]);
+    return offMap ? res | edge : res & ~edge;
+}
+// Rows of 64 cells or more: whole words first, then the bits within them
+Words shiftedFar(Words const& map, size_t const& n, bool const& up) {
+    Words res;
+    size_t q = n >> 6, b = n & 63;
+    for (size_t i = q; i < 4; i++)
+        res.w[up ? i : i - q] = map.w[up ? i - q : i];
+    for (size_t k = 0; b && k < 3; k++) {
+        size_t i = up ? 3 - k : k;
+        res.w[i] = up ? res.w[i] << b | res.w[i - 1] >> (64 - b) : res.w[i] >> b | res.w[i + 1] << (64 - b);
     }
-    for (int r = 0; r < Rows; r++) {
-        for (int c = 0; c < Cols; c++) {
-            if (getBlk(r, c) == WALL)
-                this->wallMap[to1D(r, c)] = 1;
-        }
+    if (b)
+        res.w[up ? 0 : 3] = up ? res.w[0] << b : res.w[3] >> b;
+    return res;
+}
+DeadPushes::DeadPushes(bs256 const& boxMap, unsigned const& deadRules) {
+    PROFILE_SCOPE(PHASE_DEADLOCK);
+    Words boxes(boxMap), offTarget(~ctx->targetMap);
+    if (deadRules & (1u << DEAD_SQUARE))
+        square = Words(ctx->tables->deadMap);
+    // Stuck when the other three cells are walls or boxes and one box is off
+    // target. Shifts distribute over & and |, so the cell beside the destination
+    // and the corner past it come out of one shift of the pair they form.
+    if (deadRules & (1u << DEAD_BLOCK)) {
+        Words blocked = Words(ctx->wallMap) | boxes, offTargetBoxes = boxes & offTarget;
+        Words nearBlocked = shifted<LEFT, true>(blocked), nearOffTarget = shifted<LEFT, false>(offTargetBoxes);
+        block[2 * UP] = nearBlocked & shifted<UP, true>(blocked & nearBlocked) &
+                        (nearOffTarget | shifted<UP, false>(offTargetBoxes | nearOffTarget) | offTarget);
+        block[2 * DOWN] = nearBlocked & shifted<DOWN, true>(blocked & nearBlocked) &
+                          (nearOffTarget | shifted<DOWN, false>(offTargetBoxes | nearOffTarget) | offTarget);
+        nearBlocked = shifted<RIGHT, true>(blocked);
+        nearOffTarget = shifted<RIGHT, false>(offTargetBoxes);
+        block[2 * UP + 1] = nearBlocked & shifted<UP, true>(blocked & nearBlocked) &
+                            (nearOffTarget | shifted<UP, false>(offTargetBoxes | nearOffTarget) | offTarget);
+        block[2 * DOWN + 1] = nearBlocked & shifted<DOWN, true>(blocked & nearBlocked) &
+                              (nearOffTarget | shifted<DOWN, false>(offTargetBoxes | nearOffTarget) | offTarget);
+    }
+    if (deadRules & (1u << DEAD_PATTERN)) {
+        PROFILE_SCOPE(PHASE_PATTERN);
+        array<Words, STOP> pairs;
+        for (size_t side = UP; side < STOP; side++)
+            pairs[side] = Words(ctx->tables->deadPairs[side]);
+        if (pairs[UP].any())
+            pattern[UP] = pairs[UP] & shifted<UP, false>(boxes);
+        if (pairs[DOWN].any())
+            pattern[DOWN] = pairs[DOWN] & shifted<DOWN, false>(boxes);
+        if (pairs[LEFT].any())
+            pattern[LEFT] = pairs[LEFT] & shifted<LEFT, false>(boxes);
+        if (pairs[RIGHT].any())
+            pattern[RIGHT] = pairs[RIGHT] & shifted<RIGHT, false>(boxes);
     }
 }
-Sokoban::State::State(State const& obj) {
-    this->boxMap = obj.boxMap;
-    this->wallMap = obj.wallMap;
-    this->hashValue = obj.hashValue;
-    this->pos = obj.pos;
-    this->moveSequence = obj.moveSequence;
-    this->filled = obj.filled;
-    this->dead = obj.dead;
+uint8_t DeadPushes::verdict(size_t const& cell, size_t const& dir) const {
+    // The box just left the cell on the from side, which holds no box any more
+    size_t from = opposite(dir);
+    if (square[cell])
+        return DEAD_SQUARE;
+    for (size_t v = UP; v < LEFT; v++) {
+        for (size_t h = LEFT; h < STOP; h++) {
+            if (v != from && h != from && block[2 * v + h - LEFT][cell])
+                return DEAD_BLOCK;
+        }
+    }
+    for (size_t side = UP; side < STOP; side++) {
+        if (side != from && pattern[side][cell])
+            return DEAD_PATTERN;
+    }
+    return ALIVE;
 }
-Sokoban::State& Sokoban::State::operator=(State const& rhs) {
-    this->boxMap = rhs.boxMap;
-    this->wallMap = rhs.wallMap;
-    this->hashValue = rhs.hashValue;
-    this->pos = rhs.pos;
-    this->moveSequence = rhs.moveSequence;
-    this->filled = rhs.filled;
-    this->dead = rhs.dead;
-    return *this;
+bs256 flood(size_t const& from, bs256 const& free) {
+    PROFILE_SCOPE(PHASE_FLOOD);
+    // Grow the region one step in all four directions per round with whole-word
+    // shifts. Rows wrap around in the 1D layout, but the border is all walls so
+    // nothing leaks into the next row.
+    bs256 went, prev;
+    went[from] = 1;
+    do {
+        prev = went;
+        went |= ((went << 1) | (went >> 1) | (went << ctx->Cols) | (went >> ctx->Cols)) & free;
+    } while (went != prev);
+    return went;
 }
-bool Sokoban::State::canMovePly(Position const& curpos, int const& dir) const {
-    Position nxtPos = curpos + dir, nnxtPos = curpos + dir + dir;
-    bool res = false;
-    if (getBlk(nxtPos) != WALL)
-        switch (getBlk(nxtPos)) {
-            case EMPTY:
-            case TARGET:
-            case FRAGILE:
-                if (this->boxMap[to1D(nxtPos)]) {
-                    if (getBlk(nnxtPos) != FRAGILE && getBlk(nnxtPos) != WALL && !this->boxMap[to1D(nnxtPos)])
-                        res = true;
-                } else {
-                    res = true;
-                }
-                break;
-            default:
-                break;
+static bool roomPath(bs256 const& others, size_t const& box, size_t const& dir, size_t const& target, bs256 const& cells, vector<pair<uint8_t, uint8_t>>& pushes) {
+    // BFS over (box cell, last push direction) inside the room; the player
+    // stands behind the box after each push and walks around the others
+    array<array<int, STOP>, 256> from;
+    for (auto& f : from) f.fill(-1);
+    queue<int> que;
+    from[box][dir] = box * STOP + dir;
+    que.emplace(box * STOP + dir);
+    while (!que.empty()) {
+        int node = que.front();
+        que.pop();
+        size_t b = node / STOP, d = node % STOP;
+        if (b == target) {
+            vector<pair<uint8_t, uint8_t>> path;
+            for (; node != from[b][d]; node = from[b][d], b = node / STOP, d = node % STOP)
+                path.emplace_back(step(step(b, opposite(d)), opposite(d)), d);
+            pushes.insert(pushes.end(), path.rbegin(), path.rend());
+            return true;
         }
-    return res;
+        bs256 blocked = ctx->wallMap | others;
+        blocked[b] = 1;
+        bs256 reach = flood(step(b, opposite(d)), ~blocked);
+        for (size_t nd = UP; nd < STOP; nd++) {
+            size_t ply = step(b, opposite(nd)), nxt = step(b, nd);
+            if (!reach[ply] || !cells[nxt] || others[nxt] || (tile(nxt) & TILE_FRAGILE) || from[nxt][nd] >= 0)
+                continue;
+            from[nxt][nd] = node;
+            que.emplace(nxt * STOP + nd);
+        }
+    }
+    return false;
 }
-void Sokoban::State::movePly(int const& dir) {
-    Position nxtPos = this->pos + dir, nnxtPos = this->pos + dir + dir;
-    switch (getBlk(nxtPos)) {
-        case EMPTY:
-        case TARGET:
-        case FRAGILE:
-            if (this->boxMap[to1D(nxtPos)]) {
-                this->boxMap[to1D(nxtPos)] = 0;
-                this->boxMap[to1D(nnxtPos)] = 1;
-
-                if (getBlk(nxtPos) == TARGET)
-                    this->filled--;
-                if (getBlk(nnxtPos) == TARGET)
-                    this->filled++;
-                this->hashValue ^= zobrist[to1D(nxtPos)];
-                this->hashValue ^= zobrist[to1D(nnxtPos)];
-
-                if (getBlk(nnxtPos + UP) == WALL || getBlk(nnxtPos + DOWN) == WALL) {
-                    if (getBlk(nnxtPos + LEFT) == WALL || getBlk(nnxtPos + RIGHT) == WALL)
-                        this->wallMap[to1D(nnxtPos)] = true;
+vector<pair<uint8_t, uint8_t>> macroPushes(bs256 const& boxMap, size_t box, size_t const& dir, unsigned const& macros) {
+    // Pushes that follow the one which just moved a box onto `box`, as
+    // (player cell, direction): down a tunnel, or into a goal room to its target
+    PROFILE_SCOPE(PHASE_MACRO);
+    vector<pair<uint8_t, uint8_t>> pushes;
+    bs256 others = boxMap;
+    others[box] = 0;
+    while (true) {
+        size_t nxt = step(box, dir);
+        int room = ctx->tables->roomOf[box];
+        GoalRoom const& goal = ctx->tables->goalRooms[max(room, 0)];
+        if ((macros & MACRO_ROOM) && room >= 0 && goal.entrance == step(box, opposite(dir))) {
+            for (int i = 0; i < goal.fills; i++) {
+                size_t target = goal.fillOrder[i];
+                if (!others[target]) {
+                    roomPath(others, box, dir, target, goal.cells, pushes);
+                    break;
                 }
-
-                if (!this->dead)
-                    this->dead = deadMap[to1D(nnxtPos)];
-                if (!this->dead)
-                    for (size_t v = UP; v < LEFT; v++) {
-                        for (size_t h = LEFT; h < STOP; h++) {
-                            int tot = 0;
-                            if (getBlk(nnxtPos) == WALL || this->boxMap[to1D(nnxtPos)])
-                                tot++;
-                            if (getBlk(nnxtPos + v) == WALL || this->boxMap[to1D(nnxtPos + v)])
-                                tot++;
-                            if (getBlk(nnxtPos + h) == WALL || this->boxMap[to1D(nnxtPos + h)])
-                                tot++;
-                            if (getBlk(nnxtPos + v + h) == WALL || this->boxMap[to1D(nnxtPos + v + h)])
-                                tot++;
-                            if (tot == 4) {
-                                this->wallMap[to1D(nnxtPos)] = 1;
-                                this->wallMap[to1D(nnxtPos + v)] = 1;
-                                this->wallMap[to1D(nnxtPos + h)] = 1;
-                                this->wallMap[to1D(nnxtPos + v + h)] = 1;
-                                if (!this->dead)
-                                    if (getBlk(nnxtPos) != TARGET)
-                                        this->dead = true;
-                                if (!this->dead)
-                                    if (this->boxMap[to1D(nnxtPos + v)] && getBlk(nnxtPos + v) != TARGET)
-                                        this->dead = true;
-                                if (!this->dead)
-                                    if (this->boxMap[to1D(nnxtPos + h)] && getBlk(nnxtPos + h) != TARGET)
-                                        this->dead = true;
-                                if (!this->dead)
-                                    if (this->boxMap[to1D(nnxtPos + v + h)] && getBlk(nnxtPos + v + h) != TARGET)
-                                        this->dead = true;
-                            }
-                        }
-                    }
-                if (!this->dead)
-                    if (deadPointsArray.find(nnxtPos) != deadPointsArray.end()) {
-                        for (auto ptsSet : deadPointsArray[nnxtPos]) {
-                            bool flag = true;
-                            for (auto pt : ptsSet) {
-                                if (!this->boxMap[to1D(pt)])
-                                    flag = false;
-                            }
-                            if (flag)
-                                this->dead = true;
-                        }
-                    }
             }
-            break;
-        case WALL:
-        default:
-            break;
+            return pushes;
+        }
+        if (!(macros & MACRO_TUNNEL) || !ctx->tables->tunnelMap[dir][box] || (tile(nxt) & TILE_NOBOX) || others[nxt])
+            return pushes;
+        pushes.emplace_back(step(box, opposite(dir)), dir);
+        box = nxt;
     }
-    this->pos = pos + dir;
-    this->moveSequence.push_back(toKey(dir));
 }
-vector<Sokoban::State*> Sokoban::State::nextStates() const {
-    vector<State*> res;
-    queue<pair<Position, string>> que;
-    bs256 went;
-    que.emplace(pos, "");
-    went[to1D(pos)] = 1;
-
-    while (!que.empty()) {
-        auto [curPos, curSeq] = que.front();
-        que.pop();
-
-        for (size_t dir = UP; dir < STOP; dir++) {
-            Position nxtPos = curPos + dir;
-            string nxtSeq = curSeq + toKey(dir);
-            if (!went[to1D(nxtPos)]) {
-                if (this->boxMap[to1D(nxtPos)]) {
-                    if (this->canMovePly(curPos, dir)) {
-                        State* nxtState = new State(*this);
-                        nxtState->pos = curPos;
-                        nxtState->moveSequence += curSeq;
-                        nxtState->movePly(dir);
-                        if (!nxtState->isDead())
-                            res.emplace_back(nxtState);
-                        else
-                            delete nxtState;
-                    }
-                } else if (/* getBlk(nxtPos) != WALL */ !this->wallMap[to1D(nxtPos)]) {
-                    went[to1D(nxtPos)] = 1;
-                    que.emplace(nxtPos, nxtSeq);
+bool deadCluster(bs256 const& cluster) {
+    // Solve the cluster alone: the other boxes can only get in its way, so if
+    // no player region lets its boxes all reach targets, any state holding it
+    // is dead. A sub-search that runs out of nodes proves nothing.
+    vector<uint8_t> boxes;
+    for (size_t box = cluster._Find_first(); box < cluster.size(); box = cluster._Find_next(box))
+        boxes.emplace_back(box);
+    auto encode = [](vector<uint8_t> const& boxes, size_t const& pos) {
+        uint64_t key = pos;
+        for (uint8_t box : boxes)
+            key = key << 8 | box;
+        return key;
+    };
+    bs256 covered = ctx->wallMap | cluster;
+    for (int start = 0; start < ctx->Rows * ctx->Cols; start++) {
+        if (covered[start])
+            continue;
+        bs256 region = flood(start, ~covered);
+        covered |= region;
+        unordered_set<uint64_t> seen{encode(boxes, region._Find_first())};
+        queue<pair<vector<uint8_t>, size_t>> que;
+        que.emplace(boxes, region._Find_first());
+        while (!que.empty()) {
+            if (seen.size() > LEARN_NODES)
+                return false;
+            auto [cur, pos] = que.front();
+            que.pop();
+            bs256 boxMap;
+            for (uint8_t box : cur)
+                boxMap[box] = 1;
+            bs256 reach = flood(pos, ~(ctx->wallMap | boxMap));
+            for (size_t i = 0; i < cur.size(); i++) {
+                for (size_t dir = UP; dir < STOP; dir++) {
+                    size_t nxt = step(cur[i], dir);
+                    if (!reach[step(cur[i], opposite(dir))] || (tile(nxt) & TILE_NOBOX) || boxMap[nxt] || ctx->tables->deadMap[nxt])
+                        continue;
+                    vector<uint8_t> nxtBoxes = cur;
+                    nxtBoxes[i] = nxt;
+                    sort(nxtBoxes.begin(), nxtBoxes.end());
+                    if (all_of(nxtBoxes.begin(), nxtBoxes.end(), [](uint8_t box) { return tile(box) & TILE_TARGET; }))
+                        return false;
+                    bs256 nxtBoxMap = boxMap;
+                    nxtBoxMap[cur[i]] = 0;
+                    nxtBoxMap[nxt] = 1;
+                    size_t nxtPos = flood(cur[i], ~(ctx->wallMap | nxtBoxMap))._Find_first();
+                    if (seen.insert(encode(nxtBoxes, nxtPos)).second)
+                        que.emplace(nxtBoxes, nxtPos);
                 }
             }
         }
     }
-    return res;
-}
-bool Sokoban::State::solved() const {
-    return this->getFilled() == (int)Targets.size();
+    return true;
 }
-bool Sokoban::State::isDead() const {
-    return this->dead;
-}
-int const& Sokoban::State::getFilled() const {
-    return this->filled;
+uint64_t fnv1a(string const& text) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (unsigned char c : text) {
+        hash ^= c;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
 }
-bs256 Sokoban::State::getFloodedMap() const {
-    bs256 went;
-    queue<Position> que;
-    que.emplace(this->pos);
-    went[to1D(this->pos)] = 1;
-    while (!que.empty()) {
-        Position curPos = que.front();
-        que.pop();
-        for (size_t dir = UP; dir < STOP; dir++) {
-            Position nxtPos = curPos + dir;
-            if (!went[to1D(nxtPos)]) {
-                if (/* getBlk(nxtPos) != WALL */ !this->wallMap[to1D(nxtPos)] && !this->boxMap[to1D(nxtPos)]) {
-                    que.emplace(nxtPos);
-                    went[to1D(nxtPos)] = 1;
-                }
-            }
+bool MappedFile::map(string const& path) {
+    unmap();
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* mem = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mem != MAP_FAILED) {
+            addr = static_cast<char const*>(mem);
+            length = st.st_size;
         }
     }
-    return went;
+    close(fd);
+    return addr != nullptr;
 }
-bs256 const& Sokoban::State::getBoxMap() const {
-    return this->boxMap;
+void MappedFile::unmap() {
+    if (addr)
+        munmap(const_cast<char*>(addr), length);
+    addr = nullptr;
+    length = 0;
 }
-int const& Sokoban::State::getHashValue() const {
-    return this->hashValue;
-}
-string Sokoban::State::getMoveSequence() const {
-    return this->moveSequence;
+
+void ThreadBudget::release() {
+    idle++;
 }
-Position const& Sokoban::State::getPos() const {
-    return this->pos;
+bool ThreadBudget::acquire() {
+    int n = idle.load();
+    while (n > 0) {
+        if (idle.compare_exchange_weak(n, n - 1))
+            return true;
+    }
+    return false;
 }
-void Sokoban::getInput(char* file_path) {
-    ifstream input_file;
-    string input_line;
-    Position ply;
-    bs256 boxMap;
-
-    input_file.open(file_path);
-    if (!input_file)
-        cerr << "No file found.\n";
-
-    while (getline(input_file, input_line))
-        input.emplace_back(input_line);
-
-    Rows = input.size();
-    Cols = input[0].size();
 
-    for (int r = 0; r < Rows; r++) {
-        for (int c = 0; c < Cols; c++) {
-            to1DArray[r][c] = r * Cols + c;
+mutex profilesLock;
+vector<unique_ptr<Profile>> profiles;
+string profilePath;  // JSON summary, stderr when empty
+Profile& profile() {
+    thread_local Profile* mine = nullptr;
+    if (!mine) {
+        lock_guard<mutex> guard(profilesLock);
+        profiles.emplace_back(new Profile());
+        mine = profiles.back().get();
+    }
+    return *mine;
+}
+uint64_t cycleCount() {
+#if PROFILE && defined(__x86_64__)
+    return __rdtsc();
+#else
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+void dumpProfile() {
+    lock_guard<mutex> guard(profilesLock);
+    Profile total;
+    for (auto const& p : profiles) {
+        for (int i = 0; i < PHASES; i++) {
+            total.cycles[i] += p->cycles[i];
+            total.calls[i] += p->calls[i];
+        }
+        for (int i = 0; i < COUNTERS; i++)
+            total.counts[i] += p->counts[i];
+    }
+    auto write = [&](ostream& os, Profile const& p, bool json) {
+        for (int i = 0; i < PHASES; i++) {
+            if (json)
+                os << (i ? ", " : "") << "\"" << phaseNames[i] << "\": {\"cycles\": " << p.cycles[i] << ", \"calls\": " << p.calls[i] << "}";
+            else
+                os << "  " << phaseNames[i] << ": " << p.cycles[i] << " cycles, " << p.calls[i] << " calls\n";
+        }
+        for (int i = 0; i < COUNTERS; i++) {
+            if (json)
+                os << ", \"" << counterNames[i] << "\": " << p.counts[i];
+            else
+                os << "  " << counterNames[i] << ": " << p.counts[i] << "\n";
         }
+    };
+    if (profilePath.empty()) {
+        cerr << "profile (" << profiles.size() << " threads):\n";
+        write(cerr, total, false);
+        return;
+    }
+    ofstream out(profilePath);
+    out << "{\"total\": {";
+    write(out, total, true);
+    out << "}, \"threads\": [";
+    for (size_t t = 0; t < profiles.size(); t++) {
+        out << (t ? ", " : "") << "{";
+        write(out, *profiles[t], true);
+        out << "}";
     }
+    out << "]}\n";
+    if (!out)
+        cerr << "Cannot write " << profilePath << ".\n";
+}
 
-    for (int r = 0; r < Rows; r++) {
-        for (int c = 0; c < Cols; c++) {
-            zobrist[to1D(r, c)] = rand();
+template <typename T>
+NodeArena<T>::NodeArena(int threads) : slabs(MAX_SLABS, nullptr), pools(threads), slabCount(0) {}
+template <typename T>
+NodeArena<T>::~NodeArena() {
+    for (T* slab : slabs)
+        ::operator delete(slab);
+}
+template <typename T>
+StateIdx NodeArena<T>::push(T const& obj, int tid) {
+    Pool& pool = pools[tid];
+    if (pool.next == pool.end) {
+        StateIdx slab = slabCount.fetch_add(1);
+        if (slab >= MAX_SLABS) {
+            cerr << "Node arena exhausted.\n";
+            exit(1);
         }
+        if (!slabs[slab])
+            slabs[slab] = static_cast<T*>(::operator new(sizeof(T) * SLAB_SIZE));
+        pool.next = slab << SLAB_BITS;
+        pool.end = pool.next + SLAB_SIZE;
     }
+    StateIdx idx = pool.next++;
+    new (&(*this)[idx]) T(obj);
+    return idx;
+}
+template <typename T>
+void NodeArena<T>::pop(StateIdx const& idx, int tid) {
+    // Only the most recent node of a pool can be handed back
+    if (pools[tid].next == idx + 1)
+        pools[tid].next--;
+}
+template <typename T>
+void NodeArena<T>::clear() {
+    slabCount = 0;
+    for (Pool& pool : pools)
+        pool.next = pool.end = 0;
+}
+template <typename T>
+size_t NodeArena<T>::bytes() const {
+    return (size_t)min(slabCount.load(memory_order_relaxed), MAX_SLABS) * SLAB_SIZE * sizeof(T);
+}
+template <typename T>
+T& NodeArena<T>::operator[](StateIdx const& idx) {
+    return slabs[idx >> SLAB_BITS][idx & (SLAB_SIZE - 1)];
+}
+template <typename T>
+T const& NodeArena<T>::operator[](StateIdx const& idx) const {
+    return slabs[idx >> SLAB_BITS][idx & (SLAB_SIZE - 1)];
+}
 
-    // Build initial map
-    for (int r = 0; r < Rows; r++) {
-        for (int c = 0; c < Cols; c++) {
-            if (input[r][c] == PLY || input[r][c] == PLYT || input[r][c] == PLYF) {
-                ply = make_pair(r, c);
-                input[r][c] = rmPly(input[r][c]);
-            }
-            if (input[r][c] == BOX || input[r][c] == BOXT) {
-                boxMap[to1D(r, c)] = 1;
-                input[r][c] = rmBox(input[r][c]);
+Sokoban::State::State(Position const& pos, bs256 const& boxMap) : State() {
+    int n = 0;
+    for (int r = 0; r < ctx->Rows; r++) {
+        for (int c = 0; c < ctx->Cols; c++) {
+            if (boxMap[to1D(r, c)] && n < MAX_BOXES) {
+                this->boxes[n++] = to1D(r, c);
+                if (getBlk(r, c) == TARGET)
+                    this->filled++;
+                this->hashValue ^= ctx->zobrist[to1D(r, c)];
             }
-            if (input[r][c] == TARGET)
-                Targets.emplace_back(r, c);
         }
-        initMap.append(input[r]);
     }
-    // Build dead points array
-    for (auto deadMask : deadMasks) {
-        for (int row = 0; row < Rows - deadMask.size() + 1; row++) {
-            for (int col = 0; col < Cols - deadMask[0].size() + 1; col++) {
-                bool flag = true;
-                int tg = 0, wl = 0;
-                set<Position> pts;
-                for (int r = 0; flag && r < deadMask.size(); r++) {
-                    for (int c = 0; flag && c < deadMask[0].size(); c++) {
-                        if (deadMask[r][c] == '#') {
-                            if (getBlk(row + r, col + c) == WALL)
-                                wl++;
-                        } else if (deadMask[r][c] == 'x' || deadMask[r][c] == '.') {
-                            if (getBlk(row + r, col + c) == TARGET)
-                                tg++;
-                            if (deadMask[r][c] == 'x')
-                                pts.emplace(row + r, col + c);
-                        }
-                    }
-                }
-                if (tg < 2 && wl >= 4) {
-                    for (auto pt1 : pts) {
-                        deadPointsArray[pt1].emplace_back(pts);
-                    }
+    this->pos = to1D(pos);
+    this->pos = this->getFloodedMap(boxMap)._Find_first();
+}
+bool Sokoban::State::canMovePly(bs256 const& boxMap, size_t const& cur, size_t const& dir) const {
+    size_t nxt = step(cur, dir), nnxt = step(nxt, dir);
+    if (tile(nxt) & TILE_WALL)
+        return false;
+    return !boxMap[nxt] || (!(tile(nnxt) & TILE_NOBOX) && !boxMap[nnxt]);
+}
+void Sokoban::State::movePly(bs256& boxMap, size_t const& cur, size_t const& dir, unsigned const& deadRules) {
+    size_t nxt = step(cur, dir), nnxt = step(nxt, dir);
+    this->pos = nxt;
+    if ((tile(nxt) & TILE_WALL) || !boxMap[nxt])
+        return;
+    boxMap[nxt] = 0;
+    boxMap[nnxt] = 1;
+    this->moveBox(nxt, nnxt);
+    this->pushPos = cur;
+    this->pushDir = dir;
+
+    PROFILE_SCOPE(PHASE_DEADLOCK);
+    if (!this->dead && (deadRules & (1u << DEAD_SQUARE)))
+        if (ctx->tables->deadMap[nnxt])
+            this->dead = DEAD_SQUARE;
+    if (!this->dead && (deadRules & (1u << DEAD_BLOCK)))
+        // Any 2x2 square of walls and boxes through the box is stuck, unless
+        // every box in it already sits on a target
+        for (size_t v = UP; v < LEFT && !this->dead; v++) {
+            for (size_t h = LEFT; h < STOP && !this->dead; h++) {
+                array<size_t, 4> square = {nnxt, step(nnxt, v), step(nnxt, h), step(step(nnxt, v), h)};
+                bool blocked = true, offTarget = false;
+                for (size_t cell : square) {
+                    blocked &= (tile(cell) & TILE_WALL) || boxMap[cell];
+                    offTarget |= boxMap[cell] && !(tile(cell) & TILE_TARGET);
                 }
+                if (blocked && offTarget)
+                    this->dead = DEAD_BLOCK;
+            }
+        }
+    if (!this->dead && (deadRules & (1u << DEAD_PATTERN))) {
+        PROFILE_SCOPE(PHASE_PATTERN);
+        for (size_t side = UP; side < STOP; side++) {
+            if (ctx->tables->deadPairs[side][nnxt] && boxMap[step(nnxt, side)]) {
+                this->dead = DEAD_PATTERN;
+                break;
             }
         }
     }
-    // Build dead map
-    for (int row = 0; row < Rows; row++) {
-        for (int col = 0; col < Cols; col++) {
-            Position curpos(row, col);
-            if (getBlk(curpos) == EMPTY) {
-                if (!deadMap[to1D(curpos)])
-                    for (size_t v = UP; v <= DOWN; v++) {
-                        Position leftpos = curpos;
-                        Position rightpos = curpos;
-                        while (getBlk(leftpos) == EMPTY && getBlk(leftpos + v) == WALL) leftpos = leftpos + LEFT;
-                        while (getBlk(rightpos) == EMPTY && getBlk(rightpos + v) == WALL) rightpos = rightpos + RIGHT;
-                        if (getBlk(leftpos) == WALL && getBlk(rightpos) == WALL)
-                            deadMap[to1D(curpos)] = true;
-                    }
-                if (!deadMap[to1D(curpos)])
-                    for (size_t h = LEFT; h <= RIGHT; h++) {
-                        Position uppos = curpos;
-                        Position downpos = curpos;
-                        while (getBlk(uppos) == EMPTY && getBlk(uppos + h) == WALL) uppos = uppos + UP;
-                        while (getBlk(downpos) == EMPTY && getBlk(downpos + h) == WALL) downpos = downpos + DOWN;
-                        if (getBlk(uppos) == WALL && getBlk(downpos) == WALL)
-                            deadMap[to1D(curpos)] = true;
-                    }
-                if (!deadMap[to1D(curpos)])
-                    if (getBlk(curpos + UP) == WALL || getBlk(curpos + DOWN) == WALL) {
-                        if (getBlk(curpos + LEFT) == WALL || getBlk(curpos + RIGHT) == WALL)
-                            deadMap[to1D(curpos)] = true;
-                    }
+    if (!this->dead && (deadRules & (1u << DEAD_FREEZE))) {
+        bs256 fixed;
+        bool offTarget = false;
+        if (isFrozen(boxMap, nnxt, fixed, offTarget) && offTarget)
+            this->dead = DEAD_FREEZE;
+    }
+    if (!this->dead && (deadRules & (1u << DEAD_LEARNED))) {
+        // The boxes touching the pushed one, diagonals included
+        bs256 cluster;
+        vector<size_t> stack{nnxt};
+        cluster[nnxt] = 1;
+        bool offTarget = false;
+        while (!stack.empty() && (int)cluster.count() <= LEARN_BOXES) {
+            size_t cell = stack.back();
+            stack.pop_back();
+            offTarget |= !(tile(cell) & TILE_TARGET);
+            size_t up = step(cell, UP), down = step(cell, DOWN);
+            for (size_t nxt : {up, down, step(cell, LEFT), step(cell, RIGHT), step(up, LEFT), step(up, RIGHT), step(down, LEFT), step(down, RIGHT)}) {
+                if (boxMap[nxt] && !cluster[nxt]) {
+                    cluster[nxt] = 1;
+                    stack.emplace_back(nxt);
+                }
             }
         }
+        if (offTarget && cluster.count() >= 2 && (int)cluster.count() <= LEARN_BOXES) {
+            auto it = ctx->learned.find(cluster);
+            bool dead = it != ctx->learned.end() ? it->second : ctx->learned.insert({cluster, deadCluster(cluster)}).first->second;
+            if (dead)
+                this->dead = DEAD_LEARNED;
+        }
+    }
+    if (!this->dead && (deadRules & (1u << DEAD_BIPARTITE)))
+        if (!this->matchable())
+            this->dead = DEAD_BIPARTITE;
+}
+void Sokoban::State::moveBox(size_t const& from, size_t const& to) {
+    // Keep the box list sorted: replace the moved box and bubble it into place
+    int i = 0;
+    while (this->boxes[i] != from) i++;
+    this->boxes[i] = to;
+    while (i > 0 && this->boxes[i - 1] > this->boxes[i]) {
+        swap(this->boxes[i - 1], this->boxes[i]);
+        i--;
     }
+    while (i + 1 < ctx->Boxes && this->boxes[i + 1] < this->boxes[i]) {
+        swap(this->boxes[i + 1], this->boxes[i]);
+        i++;
+    }
+    this->hashValue ^= ctx->zobrist[from];
+    this->hashValue ^= ctx->zobrist[to];
 
-    // Create initial state
-    initState = State(ply, boxMap);
-    return;
+    // Forward states count boxes on targets, backward ones boxes on their start cells
+    if (this->backward) {
+        this->filled += ctx->startBoxMap[to];
+        this->filled -= ctx->startBoxMap[from];
+    } else {
+        this->filled += (tile(to) & TILE_TARGET) != 0;
+        this->filled -= (tile(from) & TILE_TARGET) != 0;
+    }
 }
-string Sokoban::bfs() {
-    string ans;
-    bool solved = false;
-    priority_queue<State*, vector<State*>, StateCmp> statesQue;
-    unordered_map<int, bs256> statesMap;
-    statesQue.emplace(new State(initState));
-    statesMap[initState.getHashValue()] |= initState.getFloodedMap();
+void Sokoban::State::pullPly(bs256& boxMap, size_t const& cur, size_t const& dir) {
+    // The player at cur pulls the box at cur + dir while stepping back
+    size_t box = step(cur, dir), nxt = step(cur, opposite(dir));
+    boxMap[box] = 0;
+    boxMap[cur] = 1;
+    this->moveBox(box, cur);
+    // Recorded as the forward push that undoes this pull
+    this->pushPos = nxt;
+    this->pushDir = dir;
+    this->pos = nxt;
+}
+vector<Sokoban::State> Sokoban::State::prevStates(StateIdx const& self) const {
+    vector<State> res;
+    bs256 boxMap = this->getBoxMap();
+    bs256 reach = this->getFloodedMap(boxMap);
 
-    while (!statesQue.empty() && !solved) {
-        auto curState = statesQue.top();
-        statesQue.pop();
-        auto nextStates = curState->nextStates();
-        for (auto nxtState : nextStates) {
-            // nxtState->print();
-            // cout << "\n";
-            auto it = statesMap.find(nxtState->getHashValue());
-            if (it == statesMap.end() || !it->second[to1D(nxtState->getPos())]) {
-                if (nxtState->solved()) {
-                    ans = nxtState->getMoveSequence();
-                    solved = true;
-                }
-                statesQue.emplace(nxtState);
-                statesMap[nxtState->getHashValue()] |= nxtState->getFloodedMap();
-            } else {
-                delete nxtState;
+    for (size_t box = boxMap._Find_first(); box < boxMap.size(); box = boxMap._Find_next(box)) {
+        for (size_t dir = UP; dir < STOP; dir++) {
+            size_t cur = step(box, opposite(dir)), nxt = step(cur, opposite(dir));
+            if (!reach[cur] || (tile(cur) & TILE_FRAGILE) || (tile(nxt) & TILE_WALL) || boxMap[nxt])
+                continue;
+            State prvState(*this);
+            bs256 prvBoxMap = boxMap;
+            prvState.parent = self;
+            prvState.pushes++;
+            prvState.pullPly(prvBoxMap, cur, dir);
+            prvState.pos = prvState.getFloodedMap(prvBoxMap)._Find_first();
+            res.emplace_back(prvState);
+        }
+    }
+    return res;
+}
+void Sokoban::State::setBackward() {
+    this->backward = true;
+    this->filled = 0;
+    for (int i = 0; i < ctx->Boxes; i++)
+        this->filled += ctx->startBoxMap[this->boxes[i]];
+}
+bool Sokoban::State::isBackward() const {
+    return this->backward;
+}
+bool Sokoban::State::isMacro() const {
+    return this->macro;
+}
+bool Sokoban::State::isFrozen(bs256 const& boxMap, size_t const& cell, bs256& fixed, bool& offTarget) const {
+    // A box is frozen when both axes are blocked by walls, by dead squares on
+    // both sides, or by boxes that are frozen themselves. The box under test
+    // acts as a wall while its neighbours are checked, which breaks cycles.
+    fixed[cell] = 1;
+    bool off = !(tile(cell) & TILE_TARGET);
+    bool frozen = true;
+    for (size_t axis = UP; axis < STOP && frozen; axis += 2) {
+        size_t lhs = step(cell, axis), rhs = step(cell, opposite(axis));
+        bool blocked = (tile(lhs) & TILE_WALL) || (tile(rhs) & TILE_WALL) || fixed[lhs] || fixed[rhs];
+        if (!blocked)
+            blocked = ctx->tables->deadMap[lhs] && ctx->tables->deadMap[rhs];
+        for (size_t nxt : {lhs, rhs}) {
+            bool nxtOff = false;
+            if (!blocked && boxMap[nxt] && isFrozen(boxMap, nxt, fixed, nxtOff)) {
+                blocked = true;
+                off |= nxtOff;
             }
         }
-        delete curState;
+        frozen = blocked;
     }
-    while (!statesQue.empty()) {
-        delete statesQue.top();
-        statesQue.pop();
+    if (frozen)
+        offTarget |= off;
+    else
+        fixed[cell] = 0;
+    return frozen;
+}
+static bool augmentMatch(array<uint8_t, MAX_BOXES> const& boxes, int const& box, uint64_t& seen, array<int, 64>& boxOf) {
+    for (uint64_t m = ctx->tables->targetMask[boxes[box]] & ~seen; m; m &= m - 1) {
+        int t = __builtin_ctzll(m);
+        seen |= 1ULL << t;
+        if (boxOf[t] < 0 || augmentMatch(boxes, boxOf[t], seen, boxOf)) {
+            boxOf[t] = box;
+            return true;
+        }
     }
-    return ans;
+    return false;
 }
-string Sokoban::parallel_bfs() {
-    string ans;
-    bool solved = false;
-    concurrent_priority_queue<State*, StateCmp> statesQue;
-    concurrent_unordered_map<int, bs256> statesMap;
-    statesQue.emplace(new State(initState));
-    statesMap[initState.getHashValue()] |= initState.getFloodedMap();
-
-    while (!statesQue.empty() && !solved) {
-        int maxThreads = min((int)statesQue.size(), 6);
-#pragma omp parallel for schedule(dynamic) num_threads(maxThreads)
-        for (int i = 0; i < maxThreads; i++) {
-            State* currState;
-            statesQue.try_pop(currState);
-            auto nextStates = currState->nextStates();
-            for (auto nxtState : nextStates) {
-                auto it = statesMap.find(nxtState->getHashValue());
-                if (it == statesMap.end() || !it->second[to1D(nxtState->getPos())]) {
-                    if (nxtState->solved()) {
-#pragma omp critical
-                        {
-                            ans = nxtState->getMoveSequence();
-                            solved = true;
-                        }
-                    }
-                    statesQue.emplace(nxtState);
-                    statesMap[nxtState->getHashValue()] |= nxtState->getFloodedMap();
-                } else {
-                    delete nxtState;
+bool Sokoban::State::matchable() const {
+    // Kuhn's matching between boxes and the targets they can still be pushed to
+    array<int, 64> boxOf;
+    boxOf.fill(-1);
+    for (int i = 0; i < ctx->Boxes; i++) {
+        uint64_t seen = 0;
+        if (!augmentMatch(this->boxes, i, seen, boxOf))
+            return false;
+    }
+    return true;
+}
+vector<Sokoban::State> Sokoban::State::nextStates(StateIdx const& self, Expansion& expansion) const {
+    PROFILE_SCOPE(PHASE_EXPAND);
+    vector<State> res;
+    bs256 boxMap = this->getBoxMap();
+    Heuristic* heuristic = expansion.heuristic;
+    if (heuristic)
+        heuristic->load(*this);
+    bs256 reach = this->getFloodedMap(boxMap);
+    DeadPushes dead(boxMap, expansion.deadRules);
+    const unsigned batched = (1u << DEAD_SQUARE) | (1u << DEAD_BLOCK) | (1u << DEAD_PATTERN);
+
+    for (size_t box = boxMap._Find_first(); box < boxMap.size(); box = boxMap._Find_next(box)) {
+        for (size_t dir = UP; dir < STOP; dir++) {
+            size_t cur = step(box, opposite(dir));
+            if (!reach[cur] || !this->canMovePly(boxMap, cur, dir))
+                continue;
+            // The batched rules are settled already: skip the pushes they kill
+            // before building a child, movePly() runs the rest
+            size_t dest = step(box, dir);
+            if (uint8_t rule = dead.verdict(dest, dir)) {
+                expansion.prunes[rule]++;
+                continue;
+            }
+            State nxtState(*this);
+            bs256 nxtBoxMap = boxMap;
+            nxtState.parent = self;
+            nxtState.pushes++;
+            nxtState.macro = false;
+            nxtState.movePly(nxtBoxMap, cur, dir, expansion.deadRules & ~batched);
+            if (!nxtState.isDead() && expansion.macros) {
+                auto pushes = macroPushes(nxtBoxMap, dest, dir, expansion.macros);
+                for (auto const& push : pushes) {
+                    if (nxtState.isDead())
+                        break;
+                    nxtState.movePly(nxtBoxMap, push.first, push.second, expansion.deadRules);
+                    dest = step(step(push.first, push.second), push.second);
                 }
+                nxtState.pushes += pushes.size();
+                nxtState.macro = !pushes.empty();
+                nxtState.pushPos = cur;
+                nxtState.pushDir = dir;
+            }
+            if (!nxtState.isDead() && heuristic) {
+                int idx = find(this->boxes.begin(), this->boxes.begin() + ctx->Boxes, box) - this->boxes.begin();
+                int h = heuristic->update(idx, dest);
+                if (h >= DIST_INF)
+                    nxtState.dead = DEAD_BIPARTITE;
+                else
+                    nxtState.heuristic = h;
+            }
+            if (!nxtState.isDead() && nxtState.pushes + (heuristic ? nxtState.heuristic : 0) >= expansion.pushBound)
+                continue;
+            if (!nxtState.isDead()) {
+                nxtState.pos = nxtState.getFloodedMap(nxtBoxMap)._Find_first();
+                res.emplace_back(nxtState);
+            } else {
+                expansion.prunes[nxtState.dead]++;
             }
-            delete currState;
         }
     }
-    while (!statesQue.empty()) {
-        State* currState;
-        statesQue.try_pop(currState);
-        delete currState;
+    return res;
+}
+bool Sokoban::State::solved() const {
+    return this->getFilled() == (int)ctx->Targets.size();
+}
+bool Sokoban::State::isDead() const {
+    return this->dead != ALIVE;
+}
+int Sokoban::State::getFilled() const {
+    return this->filled;
+}
+int Sokoban::State::getPushes() const {
+    return this->pushes;
+}
+int Sokoban::State::getHeuristic() const {
+    return this->heuristic;
+}
+void Sokoban::State::setHeuristic(int const& heuristic) {
+    this->heuristic = min(heuristic, DIST_INF);
+}
+int Sokoban::State::getCost(Order const& order) const {
+    switch (order) {
+        case ASTAR:
+            return this->pushes + this->heuristic;
+        case BEST:
+            return this->heuristic;
+        default:
+            return ctx->Boxes - this->filled;
     }
-    return ans;
 }
-
-int main(int argc, char* argv[]) {
-    if (argc != 2)
+array<uint8_t, MAX_BOXES> const& Sokoban::State::getBoxes() const {
+    return this->boxes;
+}
+bs256 Sokoban::State::getFloodedMap(bs256 const& boxMap) const {
+    return flood(this->pos, ~(ctx->wallMap | boxMap));
+}
+bs256 Sokoban::State::getBoxMap() const {
+    bs256 boxMap;
+    for (int i = 0; i < ctx->Boxes; i++)
+        boxMap[this->boxes[i]] = 1;
+    return boxMap;
+}
+void Sokoban::State::canonical(array<uint8_t, MAX_BOXES>& boxes, uint8_t& pos) const {
+    boxes = this->boxes;
+    pos = this->pos;
+    // Backward states must meet the start layout itself, never a mirror of it
+    if (!ctx->symmetric || this->backward)
+        return;
+    // The smallest of the orientations, each with its player region normalized anew
+    bs256 region = this->getFloodedMap(this->getBoxMap());
+    for (int s = 0; s < ctx->tables->symmetryCount; s++) {
+        auto const& sym = ctx->tables->symmetries[s];
+        array<uint8_t, MAX_BOXES> symBoxes = this->boxes;
+        for (int i = 0; i < ctx->Boxes; i++)
+            symBoxes[i] = sym[this->boxes[i]];
+        sort(symBoxes.begin(), symBoxes.begin() + ctx->Boxes);
+        uint8_t symPos = UINT8_MAX;
+        for (size_t cell = region._Find_first(); cell < region.size(); cell = region._Find_next(cell))
+            symPos = min(symPos, sym[cell]);
+        if (make_pair(symBoxes, symPos) < make_pair(boxes, pos)) {
+            boxes = symBoxes;
+            pos = symPos;
+        }
+    }
+}
+uint64_t Sokoban::State::getKey() const {
+    if (!ctx->symmetric || this->backward)
+        return this->hashValue ^ ctx->zobristPly[this->pos];
+    array<uint8_t, MAX_BOXES> boxes;
+    uint8_t pos;
+    this->canonical(boxes, pos);
+    uint64_t key = ctx->zobristPly[pos];
+    for (int i = 0; i < ctx->Boxes; i++)
+        key ^= ctx->zobrist[boxes[i]];
+    return key;
+}
+StateIdx const& Sokoban::State::getParent() const {
+    return this->parent;
+}
+Position Sokoban::State::getPos() const {
+    return to2D(this->pos);
+}
+Position Sokoban::State::getPushPos() const {
+    return to2D(this->pushPos);
+}
+size_t Sokoban::State::getPushDir() const {
+    return this->pushDir;
+}
+bool Sokoban::State::operator==(State const& rhs) const {
+    if (!ctx->symmetric)
+        return this->pos == rhs.pos && equal(this->boxes.begin(), this->boxes.begin() + ctx->Boxes, rhs.boxes.begin());
+    array<uint8_t, MAX_BOXES> lhsBoxes, rhsBoxes;
+    uint8_t lhsPos, rhsPos;
+    this->canonical(lhsBoxes, lhsPos);
+    rhs.canonical(rhsBoxes, rhsPos);
+    return lhsPos == rhsPos && equal(lhsBoxes.begin(), lhsBoxes.begin() + ctx->Boxes, rhsBoxes.begin());
+}
+Sokoban::VisitedTable::VisitedTable(size_t bytes, NodeArena<State> const& nodes, atomic<size_t>& collisions)
+    : mask(0), count(0), nodes(&nodes), collisions(&collisions) {
+    static_assert(sizeof(atomic<uint64_t>) == sizeof(uint64_t) && atomic<uint64_t>::is_always_lock_free);
+    size_t capacity = 1024;
+    while (capacity * 2 * sizeof(uint64_t) <= bytes) capacity *= 2;
+    // calloc leaves pages unmapped until first touched, but keys probe at random, so
+    // nearly every insert touches a new page until the whole table is resident
+    slots = static_cast<atomic<uint64_t>*>(calloc(capacity, sizeof(uint64_t)));
+    if (!slots) {
+        cerr << "Cannot allocate visited table.\n";
+        exit(1);
+    }
+    mask = capacity - 1;
+    maxLoad = capacity - capacity / 8;
+}
+Sokoban::VisitedTable::~VisitedTable() {
+    free(slots);
+}
+Sokoban::VisitedTable::Result Sokoban::VisitedTable::insert(State const& state, StateIdx const& idx, StateIdx* existing) {
+    return insert(state, state.getKey(), idx, existing);
+}
+Sokoban::VisitedTable::Result Sokoban::VisitedTable::insert(State const& state, uint64_t const& key, StateIdx const& idx, StateIdx* existing) {
+    uint64_t entry = (key & 0xffffffff00000000ULL) | (uint64_t)(idx + 1);
+    PROFILE_SCOPE(PHASE_VISITED);
+    if (count.load(memory_order_relaxed) >= maxLoad)
+        return FULL;
+    for (size_t i = key & mask, probe = 0; probe <= mask; i = (i + 1) & mask, probe++) {
+        PROFILE_COUNT(COUNT_PROBES, 1);
+        uint64_t cur = slots[i].load(memory_order_acquire);
+        while (cur == 0) {
+            if (slots[i].compare_exchange_weak(cur, entry, memory_order_acq_rel, memory_order_acquire)) {
+                count.fetch_add(1, memory_order_relaxed);
+                return INSERTED;
+            }
+            PROFILE_COUNT(COUNT_CAS_RETRIES, 1);
+        }
+        if ((cur >> 32) == (key >> 32)) {
+            if ((*nodes)[(StateIdx)cur - 1] == state) {
+                if (existing)
+                    *existing = (StateIdx)cur - 1;
+                return DUPLICATE;
+            }
+            (*collisions)++;
+        }
+    }
+    return FULL;
+}
+int Sokoban::Heuristic::load(State const& state) {
+    PROFILE_SCOPE(PHASE_HEURISTIC);
+    n = ctx->Boxes;
+    for (int i = 0; i < n; i++)
+        cells[i] = state.getBoxes()[i];
+    if (matching == GREEDY) {
+        base = 0;
+        for (int i = 0; i < n; i++)
+            base += ctx->tables->nearestDist[cells[i]];
+        return base;
+    }
+    u.fill(0);
+    v.fill(0);
+    p.fill(0);
+    for (int i = 1; i <= n; i++)
+        augment(i, u, v, p);
+    return total(p);
+}
+int Sokoban::Heuristic::update(int const& box, int const& cell) {
+    PROFILE_SCOPE(PHASE_HEURISTIC);
+    if (matching == GREEDY)
+        return base - ctx->tables->nearestDist[cells[box]] + ctx->tables->nearestDist[cell];
+    // Only row box+1 changed: drop its match and augment it back in
+    int old = cells[box];
+    cells[box] = cell;
+    cu = u;
+    cv = v;
+    cp = p;
+    for (int j = 1; j <= n; j++) {
+        if (cp[j] == box + 1)
+            cp[j] = 0;
+    }
+    augment(box + 1, cu, cv, cp);
+    int res = total(cp);
+    cells[box] = old;
+    return res;
+}
+int Sokoban::Heuristic::cost(int const& row, int const& col) const {
+    return ctx->tables->pushDist[col - 1][cells[row - 1]];
+}
+void Sokoban::Heuristic::augment(int const& row, Vec& u, Vec& v, Vec& p) {
+    array<bool, MAX_BOXES + 1> used;
+    used.fill(false);
+    minv.fill(INT_MAX);
+    p[0] = row;
+    int j0 = 0;
+    do {
+        used[j0] = true;
+        int i0 = p[j0], delta = INT_MAX, j1 = 0;
+        for (int j = 1; j <= n; j++) {
+            if (!used[j]) {
+                int cur = cost(i0, j) - u[i0] - v[j];
+                if (cur < minv[j]) {
+                    minv[j] = cur;
+                    way[j] = j0;
+                }
+                if (minv[j] < delta) {
+                    delta = minv[j];
+                    j1 = j;
+                }
+            }
+        }
+        for (int j = 0; j <= n; j++) {
+            if (used[j]) {
+                u[p[j]] += delta;
+                v[j] -= delta;
+            } else {
+                minv[j] -= delta;
+            }
+        }
+        j0 = j1;
+    } while (p[j0] != 0);
+    do {
+        int j1 = way[j0];
+        p[j0] = p[j1];
+        j0 = j1;
+    } while (j0);
+}
+int Sokoban::Heuristic::total(Vec const& p) const {
+    int res = 0;
+    for (int j = 1; j <= n; j++)
+        res += cost(p[j], j);
+    return res;
+}
+unique_lock<mutex> Sokoban::WorkQueue::acquire() {
+#if PROFILE
+    PROFILE_COUNT(COUNT_QUEUE_LOCKS, 1);
+    unique_lock<mutex> guard(lock, try_to_lock);
+    if (!guard.owns_lock()) {
+        PROFILE_COUNT(COUNT_QUEUE_CONTENDED, 1);
+        PROFILE_SCOPE(PHASE_QUEUE);
+        guard.lock();
+    }
+    return guard;
+#else
+    return unique_lock<mutex>(lock);
+#endif
+}
+void Sokoban::WorkQueue::push(StateIdx const& idx, int const& cost, bool const& backward) {
+    auto guard = acquire();
+    auto& side = buckets[backward];
+    if (cost >= (int)side.size())
+        side.resize(cost + 1);
+    side[cost].emplace_back(idx);
+    best[backward] = min(best[backward], cost);
+}
+deque<StateIdx>* Sokoban::WorkQueue::next() {
+    // Cheapest non-empty bucket, alternating between the two directions
+    turn = !turn;
+    for (int side : {(int)turn, (int)!turn}) {
+        while (best[side] < (int)buckets[side].size() && buckets[side][best[side]].empty()) best[side]++;
+        if (best[side] < (int)buckets[side].size())
+            return &buckets[side][best[side]];
+    }
+    return nullptr;
+}
+bool Sokoban::WorkQueue::pop(StateIdx& idx) {
+    auto guard = acquire();
+    auto bucket = next();
+    if (!bucket)
+        return false;
+    idx = bucket->front();
+    bucket->pop_front();
+    return true;
+}
+bool Sokoban::WorkQueue::steal(StateIdx& idx) {
+    auto guard = acquire();
+    auto bucket = next();
+    if (!bucket)
+        return false;
+    PROFILE_COUNT(COUNT_STEALS, 1);
+    idx = bucket->back();
+    bucket->pop_back();
+    return true;
+}
+string Sokoban::getMoveSequence(NodeArena<State> const& nodes, StateIdx idx, StateIdx meetIdx) const {
+    // Collect the pushes from the solved state back to the root
+    vector<State const*> path;
+    for (; nodes[idx].getParent() != NO_PARENT; idx = nodes[idx].getParent())
+        path.emplace_back(&nodes[idx]);
+    reverse(path.begin(), path.end());
+    // A backward chain already lists its undoing pushes from the meeting point to the goal
+    for (; meetIdx != NO_PARENT && nodes[meetIdx].getParent() != NO_PARENT; meetIdx = nodes[meetIdx].getParent())
+        path.emplace_back(&nodes[meetIdx]);
+
+    // Replay them from the real initial position, walking the player between pushes
+    string moveSequence;
+    bs256 boxMap = initState.getBoxMap();
+    Position curPos = initPly;
+    for (auto it = path.begin(); it != path.end(); it++) {
+        vector<pair<uint8_t, uint8_t>> pushes{{to1D((*it)->getPushPos()), (*it)->getPushDir()}};
+        if ((*it)->isMacro()) {
+            Position box = (*it)->getPushPos() + (*it)->getPushDir() + (*it)->getPushDir();
+            bs256 nxtBoxMap = boxMap;
+            nxtBoxMap[to1D(box + opposite((*it)->getPushDir()))] = 0;
+            nxtBoxMap[to1D(box)] = 1;
+            auto rest = macroPushes(nxtBoxMap, to1D(box), (*it)->getPushDir(), config.macros);
+            pushes.insert(pushes.end(), rest.begin(), rest.end());
+        }
+        for (auto const& push : pushes) {
+            Position pushPos = to2D(push.first);
+            size_t dir = push.second;
+            moveSequence += findPath(boxMap, curPos, pushPos);
+            moveSequence.push_back(toKey(dir));
+            boxMap[to1D(pushPos + dir)] = 0;
+            boxMap[to1D(pushPos + dir + dir)] = 1;
+            curPos = pushPos + dir;
+        }
+    }
+    return moveSequence;
+}
+vector<Sokoban::State> Sokoban::goalStates() const {
+    // Boxes on every target, one state per region the player may be left in
+    bs256 goalBoxMap;
+    for (auto const& target : ctx->Targets)
+        goalBoxMap[to1D(target)] = 1;
+    vector<State> res;
+    bs256 covered = ctx->wallMap | goalBoxMap;
+    for (int i = 0; i < ctx->Rows * ctx->Cols; i++) {
+        if (covered[i])
+            continue;
+        State goal(to2D(i), goalBoxMap);
+        goal.setBackward();
+        covered |= goal.getFloodedMap(goalBoxMap);
+        res.emplace_back(goal);
+    }
+    return res;
+}
+int Sokoban::countPushes(string const& moves) const {
+    bs256 boxMap = ctx->startBoxMap;
+    size_t pos = to1D(initPly);
+    int pushes = 0;
+    for (char key : moves) {
+        size_t dir = key == 'W' ? UP : key == 'S' ? DOWN : key == 'A' ? LEFT : RIGHT;
+        pos = step(pos, dir);
+        if (boxMap[pos]) {
+            boxMap[pos] = 0;
+            boxMap[step(pos, dir)] = 1;
+            pushes++;
+        }
+    }
+    return pushes;
+}
+string Sokoban::findPath(bs256 const& boxMap, Position const& from, Position const& to) const {
+    array<uint8_t, 256> from_dir;
+    bs256 went;
+    queue<Position> que;
+    que.emplace(from);
+    went[to1D(from)] = 1;
+    while (!que.empty() && !went[to1D(to)]) {
+        Position curPos = que.front();
+        que.pop();
+        for (size_t dir = UP; dir < STOP; dir++) {
+            Position nxtPos = curPos + dir;
+            if (!went[to1D(nxtPos)] && !ctx->wallMap[to1D(nxtPos)] && !boxMap[to1D(nxtPos)]) {
+                went[to1D(nxtPos)] = 1;
+                from_dir[to1D(nxtPos)] = dir;
+                que.emplace(nxtPos);
+            }
+        }
+    }
+    string path;
+    for (Position curPos = to; curPos != from; curPos = curPos + opposite(from_dir[to1D(curPos)]))
+        path.push_back(toKey(from_dir[to1D(curPos)]));
+    reverse(path.begin(), path.end());
+    return path;
+}
+bool Sokoban::getInput(char const* file_path) {
+    ifstream input_file;
+    string input_line;
+    vector<string> lines;
+
+    input_file.open(file_path);
+    if (!input_file) {
+        cerr << "No file found.\n";
+        return false;
+    }
+    while (getline(input_file, input_line))
+        lines.emplace_back(input_line);
+    return load(lines);
+}
+bool Sokoban::load(vector<string> const& lines) {
+    Position ply(-1, -1);
+    bs256 boxMap;
+
+    // Reset the level context, one Sokoban may solve many levels in a row
+    ctx = &context;
+    ctx->Boxes = 0;
+    ctx->Targets.clear();
+    ctx->initMap.clear();
+    ctx->wallMap.reset();
+    ctx->startBoxMap.reset();
+    for (auto& edge : ctx->edgeMap)
+        edge.reset();
+    ctx->targetMap.reset();
+    ctx->learned.clear();
+
+    // Pad ragged rows, level collections often strip trailing spaces
+    level = lines;
+    input = lines;
+    for (auto& line : input) {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+    }
+    if (input.empty()) {
+        cerr << "Empty level.\n";
+        return false;
+    }
+    ctx->Rows = input.size();
+    ctx->Cols = 0;
+    for (auto const& line : input)
+        ctx->Cols = max(ctx->Cols, (int)line.size());
+    for (auto& line : input)
+        line.resize(ctx->Cols, EMPTY);
+    if (ctx->Rows * ctx->Cols > 256) {
+        cerr << "Map larger than 256 tiles.\n";
+        return false;
+    }
+    string mapText;
+    for (auto const& line : input)
+        mapText += line;
+
+    for (int r = 0; r < ctx->Rows; r++) {
+        for (int c = 0; c < ctx->Cols; c++) {
+            ctx->to1DArray[r][c] = r * ctx->Cols + c;
+        }
+    }
+
+    mt19937_64 rng(ZOBRIST_SEED);
+    for (int r = 0; r < ctx->Rows; r++) {
+        for (int c = 0; c < ctx->Cols; c++) {
+            ctx->zobrist[to1D(r, c)] = rng();
+            ctx->zobristPly[to1D(r, c)] = rng();
+        }
+    }
+
+    // Build initial map
+    for (int r = 0; r < ctx->Rows; r++) {
+        for (int c = 0; c < ctx->Cols; c++) {
+            if (input[r][c] == PLY || input[r][c] == PLYT || input[r][c] == PLYF) {
+                ply = make_pair(r, c);
+                input[r][c] = rmPly(input[r][c]);
+            }
+            if (input[r][c] == BOX || input[r][c] == BOXT) {
+                boxMap[to1D(r, c)] = 1;
+                input[r][c] = rmBox(input[r][c]);
+                ctx->Boxes++;
+            }
+            if (input[r][c] == TARGET) {
+                ctx->Targets.emplace_back(r, c);
+                ctx->targetMap[to1D(r, c)] = 1;
+            }
+            if (input[r][c] == WALL)
+                ctx->wallMap[to1D(r, c)] = 1;
+        }
+        ctx->initMap.append(input[r]);
+    }
+    // Build the cell tables the hot paths work on: tile flags and the four
+    // neighbours of every cell, cells off the map being walls that lead nowhere
+    ctx->tiles.fill(TILE_WALL);
+    for (int i = 0; i < 256; i++)
+        ctx->neighbor[i].fill(i);
+    for (int r = 0; r < ctx->Rows; r++) {
+        for (int c = 0; c < ctx->Cols; c++) {
+            size_t cell = to1D(r, c);
+            char blk = getBlk(r, c);
+            ctx->tiles[cell] = blk == WALL ? TILE_WALL : blk == TARGET ? TILE_TARGET : blk == FRAGILE ? TILE_FRAGILE : 0;
+            for (size_t dir = UP; dir < STOP; dir++) {
+                Position nxt = make_pair(r, c) + dir;
+                if (nxt.first >= 0 && nxt.first < ctx->Rows && nxt.second >= 0 && nxt.second < ctx->Cols)
+                    ctx->neighbor[cell][dir] = to1D(nxt);
+                else
+                    ctx->edgeMap[dir][cell] = 1;
+            }
+        }
+    }
+    if (ctx->Boxes > MAX_BOXES) {
+        cerr << "Too many boxes, rebuild with -DMAX_BOXES=" << ctx->Boxes << ".\n";
+        return false;
+    }
+    if (ctx->Targets.size() > MAX_BOXES) {
+        cerr << "Too many targets, rebuild with -DMAX_BOXES=" << ctx->Targets.size() << ".\n";
+        return false;
+    }
+    if (ply.first < 0) {
+        cerr << "No player found.\n";
+        return false;
+    }
+    // Static analysis: mapped from the cache when it holds this very map, else built
+    if (config.cacheDir.empty() || !mapTables(mapText)) {
+        buildTables(boxMap, ply);
+        if (!config.cacheDir.empty())
+            saveTables(mapText);
+    }
+    // A bidirectional search has to meet the start layout exactly and keeps
+    // every orientation apart
+    ctx->symmetric = ctx->tables->symmetryCount > 0 && config.search != BIDIR;
+
+    // Start from the clusters judged by earlier solves of the same map
+    if (!config.learnDir.empty()) {
+        ifstream learned(learnedPath());
+        for (string line; getline(learned, line);) {
+            bs256 cluster;
+            istringstream cells(line);
+            int dead = 0;
+            cells >> dead;
+            for (int cell; cells >> cell && cell >= 0 && cell < ctx->Rows * ctx->Cols;)
+                cluster[cell] = 1;
+            if (cluster.any())
+                ctx->learned.insert({cluster, dead != 0});
+        }
+    }
+
+    // Create initial state
+    initPly = ply;
+    ctx->startBoxMap = boxMap;
+    initState = State(ply, boxMap);
+    return true;
+}
+void Sokoban::buildTables(bs256 const& boxMap, Position const& ply) {
+    ctx->builtTables.reset(new LevelTables());
+    LevelTables& tables = *ctx->builtTables;
+    ctx->tables = &tables;
+    tables.roomOf.fill(-1);
+    // Build dead points array
+    for (auto deadMask : deadMasks) {
+        for (int row = 0; row < ctx->Rows - deadMask.size() + 1; row++) {
+            for (int col = 0; col < ctx->Cols - deadMask[0].size() + 1; col++) {
+                bool flag = true;
+                int tg = 0, wl = 0;
+                bs256 pts;
+                for (int r = 0; flag && r < deadMask.size(); r++) {
+                    for (int c = 0; flag && c < deadMask[0].size(); c++) {
+                        if (deadMask[r][c] == '#') {
+                            if (getBlk(row + r, col + c) == WALL)
+                                wl++;
+                        } else if (deadMask[r][c] == 'x' || deadMask[r][c] == '.') {
+                            if (getBlk(row + r, col + c) == TARGET)
+                                tg++;
+                            if (deadMask[r][c] == 'x')
+                                pts[to1D(row + r, col + c)] = 1;
+                        }
+                    }
+                }
+                if (tg < 2 && wl >= 4) {
+                    for (size_t pt = pts._Find_first(); pt < pts.size(); pt = pts._Find_next(pt)) {
+                        for (size_t dir = UP; dir < STOP; dir++) {
+                            if (step(pt, dir) != pt && pts[step(pt, dir)])
+                                tables.deadPairs[dir][pt] = 1;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    // Build push distances to every target by pulling a box backwards from it,
+    // respecting fragile tiles that a box may never stand on
+    tables.nearestDist.fill(DIST_INF);
+    tables.targetMask.fill(0);
+    for (size_t t = 0; t < ctx->Targets.size(); t++) {
+        auto& dist = tables.pushDist[t];
+        dist.fill(DIST_INF);
+        queue<Position> que;
+        que.emplace(ctx->Targets[t]);
+        dist[to1D(ctx->Targets[t])] = 0;
+        while (!que.empty()) {
+            Position curPos = que.front();
+            que.pop();
+            for (size_t dir = UP; dir < STOP; dir++) {
+                // The box came from prvPos, pushed by a player standing at prvPos + dir
+                Position prvPos = curPos + dir;
+                if (getBlk(prvPos) == WALL || getBlk(prvPos) == FRAGILE || dist[to1D(prvPos)] != DIST_INF)
+                    continue;
+                if (getBlk(prvPos + dir) == WALL)
+                    continue;
+                dist[to1D(prvPos)] = dist[to1D(curPos)] + 1;
+                que.emplace(prvPos);
+            }
+        }
+        for (int i = 0; i < ctx->Rows * ctx->Cols; i++) {
+            tables.nearestDist[i] = min(tables.nearestDist[i], dist[i]);
+            if (dist[i] != DIST_INF)
+                tables.targetMask[i] |= 1ULL << t;
+        }
+    }
+
+    // Build dead map: no sequence of pulls brings a box on these cells back to any target
+    for (int i = 0; i < ctx->Rows * ctx->Cols; i++)
+        tables.deadMap[i] = getBlk(to2D(i)) != WALL && tables.nearestDist[i] == DIST_INF;
+
+    // Build tunnel map: a box pushed onto a non-target cell walled on both sides,
+    // with the player behind it walled in as well, can only go on being pushed
+    // The player's floor only, padding outside the walls holds no rooms
+    bs256 floorMap = flood(to1D(ply), ~ctx->wallMap), targetMap;
+    for (auto const& target : ctx->Targets)
+        targetMap[to1D(target)] = 1;
+    for (size_t dir = UP; dir < STOP; dir++) {
+        tables.tunnelMap[dir].reset();
+        size_t side = dir < LEFT ? LEFT : UP;
+        for (int r = 1; r < ctx->Rows - 1; r++) {
+            for (int c = 1; c < ctx->Cols - 1; c++) {
+                Position cur = make_pair(r, c), prv = cur + opposite(dir);
+                if (ctx->wallMap[to1D(cur)] || ctx->wallMap[to1D(prv)] || targetMap[to1D(cur)])
+                    continue;
+                tables.tunnelMap[dir][to1D(cur)] = ctx->wallMap[to1D(cur + side)] && ctx->wallMap[to1D(cur + opposite(side))] &&
+                                              ctx->wallMap[to1D(prv + side)] && ctx->wallMap[to1D(prv + opposite(side))];
+            }
+        }
+    }
+
+    // Build goal rooms: cut the floor at every cell and keep the parts behind it
+    // that hold targets only, largest first and without overlaps
+    vector<pair<size_t, GoalRoom>> rooms;
+    for (size_t e = floorMap._Find_first(); e < floorMap.size(); e = floorMap._Find_next(e)) {
+        if (targetMap[e])
+            continue;
+        bs256 free = floorMap, seen;
+        free[e] = 0;
+        for (size_t dir = UP; dir < STOP; dir++) {
+            // step() stays on e off the map, which is never free nor an entrance
+            size_t in = step(e, dir), out = step(e, opposite(dir));
+            if (!free[in] || seen[in])
+                continue;
+            bs256 cells = flood(in, free);
+            seen |= cells;
+            if ((cells & targetMap).none() || (cells & boxMap).any() || cells[to1D(ply)] || out == e || !floorMap[out])
+                continue;
+            rooms.emplace_back(cells.count(), GoalRoom{e, cells, 0, {}});
+        }
+    }
+    sort(rooms.begin(), rooms.end(), [](auto const& lhs, auto const& rhs) { return lhs.first > rhs.first; });
+    bs256 roomMap;
+    for (auto& room : rooms) {
+        GoalRoom& goal = room.second;
+        if ((goal.cells & roomMap).any())
+            continue;
+        // Targets by walking distance from the entrance, nearest first
+        vector<size_t> byDist;
+        bs256 went;
+        queue<size_t> que;
+        que.emplace(goal.entrance);
+        went[goal.entrance] = 1;
+        while (!que.empty()) {
+            size_t cur = que.front();
+            que.pop();
+            if (targetMap[cur])
+                byDist.emplace_back(cur);
+            for (size_t dir = UP; dir < STOP; dir++) {
+                size_t nxt = step(cur, dir);
+                if (goal.cells[nxt] && !went[nxt]) {
+                    went[nxt] = 1;
+                    que.emplace(nxt);
+                }
+            }
+        }
+        // Empty the full room backwards: the nearest target whose box can still
+        // come in past the other filled ones is the last to be filled
+        bs256 full = goal.cells & targetMap;
+        while (!byDist.empty()) {
+            auto last = find_if(byDist.begin(), byDist.end(), [&](size_t const& target) {
+                bs256 others = full;
+                others[target] = 0;
+                for (size_t dir = UP; dir < STOP; dir++) {
+                    size_t in = step(goal.entrance, dir);
+                    vector<pair<uint8_t, uint8_t>> pushes;
+                    if (goal.cells[in] && !others[in] && roomPath(others, in, dir, target, goal.cells, pushes))
+                        return true;
+                }
+                return false;
+            });
+            if (last == byDist.end())
+                break;
+            goal.fillOrder[goal.fills++] = *last;
+            full[*last] = 0;
+            byDist.erase(last);
+        }
+        if (!byDist.empty())
+            continue;
+        reverse(goal.fillOrder.begin(), goal.fillOrder.begin() + goal.fills);
+        roomMap |= goal.cells;
+        for (size_t i = goal.cells._Find_first(); i < goal.cells.size(); i = goal.cells._Find_next(i))
+            tables.roomOf[i] = tables.goalRoomCount;
+        tables.goalRooms[tables.goalRoomCount++] = goal;
+    }
+
+    // Rotations and mirrors that keep the player's floor, the targets and the
+    // fragile tiles in place. Symmetric states need equally many pushes to
+    // solve, so only one of them is searched.
+    bs256 floor = flood(to1D(ply), ~ctx->wallMap);
+    for (int t = 1; t < 8; t++) {
+        // Bit 2 transposes, which only maps a square board onto itself
+        if ((t & 4) && ctx->Rows != ctx->Cols)
+            continue;
+        array<uint8_t, 256> sym;
+        bool same = true;
+        for (int r = 0; same && r < ctx->Rows; r++) {
+            for (int c = 0; same && c < ctx->Cols; c++) {
+                int symR = t & 4 ? c : r, symC = t & 4 ? r : c;
+                if (t & 1)
+                    symR = ctx->Rows - 1 - symR;
+                if (t & 2)
+                    symC = ctx->Cols - 1 - symC;
+                size_t cell = to1D(r, c), symCell = to1D(symR, symC);
+                sym[cell] = symCell;
+                same = floor[cell] == floor[symCell] && (!floor[cell] || tile(cell) == tile(symCell));
+            }
+        }
+        if (same)
+            tables.symmetries[tables.symmetryCount++] = sym;
+    }
+}
+string Sokoban::learnedPath() const {
+    // Learned deadlocks depend on walls, targets and fragile tiles only, so the
+    // file is shared by every level with the same map
+    ostringstream name;
+    name << hex << fnv1a(to_string(ctx->Cols) + ctx->initMap) << ".dead";
+    return (filesystem::path(config.learnDir) / name.str()).string();
+}
+string Sokoban::tablesPath(string const& mapText) const {
+    // Goal rooms and symmetries depend on where the boxes and the player
+    // start, so unlike learned deadlocks the file is per level
+    ostringstream name;
+    name << hex << fnv1a(to_string(ctx->Cols) + mapText) << ".tables";
+    return (filesystem::path(config.cacheDir) / name.str()).string();
+}
+bool Sokoban::mapTables(string const& mapText) {
+    MappedFile& file = ctx->cachedTables;
+    if (!file.map(tablesPath(mapText)))
+        return false;
+    TablesHeader const* header = reinterpret_cast<TablesHeader const*>(file.data());
+    if (file.size() != sizeof(TablesHeader) + sizeof(LevelTables) || memcmp(header->magic, TABLES_MAGIC, sizeof(TABLES_MAGIC)) ||
+        header->version != TABLES_VERSION || header->size != sizeof(LevelTables) || header->rows != ctx->Rows ||
+        header->cols != ctx->Cols || strncmp(header->map, mapText.c_str(), sizeof(header->map))) {
+        file.unmap();
+        return false;
+    }
+    ctx->tables = reinterpret_cast<LevelTables const*>(file.data() + sizeof(TablesHeader));
+    return true;
+}
+void Sokoban::saveTables(string const& mapText) const {
+    static atomic<unsigned> serial{0};
+    TablesHeader header{};
+    memcpy(header.magic, TABLES_MAGIC, sizeof(TABLES_MAGIC));
+    header.version = TABLES_VERSION;
+    header.size = sizeof(LevelTables);
+    header.rows = ctx->Rows;
+    header.cols = ctx->Cols;
+    mapText.copy(header.map, sizeof(header.map));
+    error_code ec;
+    filesystem::create_directories(config.cacheDir, ec);
+    // Portfolio racers may write the same file at once, each renames its own
+    string path = tablesPath(mapText), tmp = path + "." + to_string(getpid()) + "." + to_string(serial++);
+    ofstream out(tmp, ios::binary);
+    out.write(reinterpret_cast<char const*>(&header), sizeof(header));
+    out.write(reinterpret_cast<char const*>(ctx->tables), sizeof(LevelTables));
+    out.close();
+    if (out)
+        filesystem::rename(tmp, path, ec);
+    if (!out || ec) {
+        filesystem::remove(tmp, ec);
+        cerr << "Cannot write " << path << ".\n";
+    }
+}
+void Sokoban::saveLearned() const {
+    static atomic<unsigned> serial{0};
+    error_code ec;
+    filesystem::create_directories(config.learnDir, ec);
+    // Batch solves of levels sharing a map may write the same file at once, each renames its own
+    string path = learnedPath(), tmp = path + "." + to_string(getpid()) + "." + to_string(serial++);
+    ofstream out(tmp);
+    // One cluster per line: 1 if dead, 0 if its sub-search found a way out, then its cells
+    for (auto const& [cluster, dead] : ctx->learned) {
+        out << dead;
+        for (size_t cell = cluster._Find_first(); cell < cluster.size(); cell = cluster._Find_next(cell))
+            out << " " << cell;
+        out << "\n";
+    }
+    out.close();
+    if (out)
+        filesystem::rename(tmp, path, ec);
+    if (!out || ec)
+        cerr << "Cannot write " << path << ".\n";
+}
+string Sokoban::bfs() {
+    StateIdx ansIdx = 0;
+    bool solved = initState.solved();
+    bool full = false;
+    nodes.clear();
+    priority_queue<StateIdx, vector<StateIdx>, StateCmp> statesQue{StateCmp(nodes, config.order)};
+    VisitedTable statesMap(config.memoryBudget / 4 << 20, nodes, stats.collisions);
+    Heuristic heuristic(config.heuristic);
+    Expansion expansion;
+    expansion.heuristic = config.order == FILLED ? nullptr : &heuristic;
+    expansion.deadRules = config.deadRules;
+    expansion.macros = config.macros;
+    expansion.pushBound = config.pushBound;
+    State root = initState;
+    if (expansion.heuristic)
+        root.setHeuristic(heuristic.load(root));
+    statesMap.insert(root, nodes.push(root));
+    statesQue.emplace(0);
+
+    size_t nodeBudget = (config.memoryBudget << 20) - (config.memoryBudget / 4 << 20);
+    while (!statesQue.empty() && !solved && !full && !cancelled()) {
+        StateIdx curIdx = statesQue.top();
+        statesQue.pop();
+        if (nodes.bytes() > nodeBudget) {
+            full = true;
+            break;
+        }
+        auto nextStates = nodes[curIdx].nextStates(curIdx, expansion);
+        stats.expanded++;
+        stats.generated += nextStates.size();
+        for (auto const& nxtState : nextStates) {
+            StateIdx nxtIdx = nodes.push(nxtState);
+            auto res = statesMap.insert(nxtState, nxtIdx);
+            if (res == VisitedTable::INSERTED) {
+                if (nxtState.solved()) {
+                    ansIdx = nxtIdx;
+                    solved = true;
+                }
+                statesQue.emplace(nxtIdx);
+            } else {
+                nodes.pop(nxtIdx);
+                if (res == VisitedTable::DUPLICATE)
+                    stats.dedupHits++;
+                else
+                    full = true;
+            }
+        }
+    }
+    for (int rule = 0; rule < DEAD_RULES; rule++)
+        stats.prunes[rule] += expansion.prunes[rule];
+    if (!solved) {
+        overflow = full;
+        // A bounded search that runs dry only rules out shorter solutions
+        if (!full && !cancelled() && config.pushBound == INT_MAX)
+            cerr << "No solution.\n";
+        return "";
+    }
+    found = true;
+    return getMoveSequence(nodes, ansIdx);
+}
+string Sokoban::solve() {
+    ctx = &context;
+    found = false;
+    overflow = false;
+    deadline = chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(config.timeLimit));
+    nodeStart = stats.expanded;
+    string moves;
+    switch (config.search) {
+        case SERIAL:
+            moves = bfs();
+            break;
+        case BIDIR:
+            moves = parallel_bfs(true);
+            break;
+        case EXTERNAL:
+            moves = external_bfs();
+            break;
+        case IDA:
+            moves = ida();
+            break;
+        case PORTFOLIO:
+            return portfolio();
+        case ANYTIME:
+            return anytime();
+        case LAYERED:
+            moves = layered_bfs();
+            break;
+        default:
+            moves = parallel_bfs();
+            break;
+    }
+    // Out of memory: start over with the frontier and the visited set on disk,
+    // which searches by transitions and cannot keep to a push bound
+    if (overflow && config.pushBound == INT_MAX) {
+        cerr << "Memory budget exceeded, searching again on disk.\n";
+        nodes.clear();
+        moves = external_bfs();
+    }
+    if (!config.learnDir.empty() && (config.deadRules & (1u << DEAD_LEARNED)))
+        saveLearned();
+    return moves;
+}
+string Sokoban::parallel_bfs(bool bidirectional) {
+    if (initState.solved()) {
+        found = true;
+        return "";
+    }
+    int threads = config.threads > 0 ? config.threads : omp_get_max_threads();
+    nodes.clear();
+    VisitedTable statesMap(config.memoryBudget / 4 << 20, nodes, stats.collisions);
+    vector<WorkQueue> frontiers(threads);
+    StateIdx ansIdx = NO_PARENT, meetIdx = NO_PARENT;
+    atomic<bool> done(false), full(false);
+    size_t nodeBudget = (config.memoryBudget << 20) - (config.memoryBudget / 4 << 20);
+    // States queued or being expanded; the space is exhausted when it drops to zero
+    atomic<size_t> pending(1);
+    State root = initState;
+    if (config.order != FILLED)
+        root.setHeuristic(Heuristic(config.heuristic).load(root));
+    StateIdx rootIdx = nodes.push(root);
+    statesMap.insert(root, rootIdx);
+    frontiers[0].push(rootIdx, root.getCost(config.order));
+    // Backward pulls start from every goal and meet the forward pushes in statesMap
+    if (bidirectional) {
+        for (auto const& goal : goalStates()) {
+            StateIdx goalIdx = nodes.push(goal);
+            if (statesMap.insert(goal, goalIdx) == VisitedTable::INSERTED) {
+                pending++;
+                frontiers[pending % threads].push(goalIdx, goal.getCost(config.order), true);
+            }
+        }
+    }
+
+    // Workers started after the first one on a thread budget
+    atomic<int> active(1);
+    function<void(int)> worker = [&](int tid) {
+        ctx = &context;
+        StateIdx curIdx;
+        size_t expanded = 0, generated = 0;
+        Heuristic heuristic(config.heuristic);
+        Expansion expansion;
+        expansion.heuristic = config.order == FILLED ? nullptr : &heuristic;
+        expansion.deadRules = config.deadRules;
+        expansion.macros = config.macros;
+        expansion.pushBound = config.pushBound;
+        while (!done.load(memory_order_relaxed)) {
+            if (cancelled()) {
+                done = true;
+                break;
+            }
+            bool found = frontiers[tid].pop(curIdx);
+            for (int i = 1; !found && i < threads; i++)
+                found = frontiers[(tid + i) % threads].steal(curIdx);
+            if (!found) {
+                if (pending.load() == 0)
+                    break;
+                sched_yield();
+                continue;
+            }
+            if (budget && tid == 0 && expanded % 64 == 0 && active < threads &&
+                pending.load(memory_order_relaxed) > GROW_FRONTIER * active && budget->acquire()) {
+                auto run = &worker;
+                auto grant = budget;
+                int helper = active++;
+#pragma omp task firstprivate(run, grant, helper)
+                {
+                    (*run)(helper);
+                    grant->release();
+                }
+            }
+            if (nodes.bytes() > nodeBudget) {
+                full = true;
+                done = true;
+                break;
+            }
+            bool backward = nodes[curIdx].isBackward();
+            auto nextStates = backward ? nodes[curIdx].prevStates(curIdx) : nodes[curIdx].nextStates(curIdx, expansion);
+            // Published in batches, config.nodeLimit is checked against the total
+            if (++expanded % 64 == 0)
+                stats.expanded += 64;
+            generated += nextStates.size();
+            for (auto const& nxtState : nextStates) {
+                StateIdx nxtIdx = nodes.push(nxtState, tid), oldIdx;
+                auto res = statesMap.insert(nxtState, nxtIdx, &oldIdx);
+                if (res == VisitedTable::INSERTED) {
+                    if (!backward && nxtState.solved()) {
+#pragma omp critical
+                        if (ansIdx == NO_PARENT)
+                            ansIdx = nxtIdx;
+                        done = true;
+                        break;
+                    }
+                    pending++;
+                    frontiers[tid].push(nxtIdx, nxtState.getCost(config.order), backward);
+                } else if (res == VisitedTable::DUPLICATE && nodes[oldIdx].isBackward() != backward) {
+                    // The two searches met: stitch the forward chain to the backward one
+#pragma omp critical
+                    if (ansIdx == NO_PARENT) {
+                        ansIdx = backward ? oldIdx : nxtIdx;
+                        meetIdx = backward ? nxtIdx : oldIdx;
+                    }
+                    done = true;
+                    break;
+                } else {
+                    nodes.pop(nxtIdx, tid);
+                    if (res == VisitedTable::DUPLICATE) {
+                        stats.dedupHits++;
+                    } else {
+                        full = true;
+                        done = true;
+                    }
+                }
+            }
+            pending--;
+        }
+        stats.expanded += expanded % 64;
+        stats.generated += generated;
+        for (int rule = 0; rule < DEAD_RULES; rule++)
+            stats.prunes[rule] += expansion.prunes[rule];
+    };
+    // On a budget the calling thread is the first worker and borrows the rest
+    if (budget) {
+        worker(0);
+#pragma omp taskwait
+    } else {
+#pragma omp parallel num_threads(threads)
+        worker(omp_get_thread_num());
+    }
+    if (ansIdx == NO_PARENT) {
+        overflow = full;
+        if (!full && !cancelled() && config.pushBound == INT_MAX)
+            cerr << "No solution.\n";
+        return "";
+    }
+    found = true;
+    return getMoveSequence(nodes, ansIdx, meetIdx);
+}
+string Sokoban::layered_bfs() {
+    // Level-synchronous breadth-first search in two bulk passes per layer.
+    // Threads expand their share of the layer into buffers of their own, one
+    // per partition of the key space, by its top bits. Then every partition
+    // is merged by a single thread into a visited table of its own, so no
+    // slot is ever contended, and the states new to it form the next layer.
+    if (initState.solved()) {
+        found = true;
+        return "";
+    }
+    int threads = config.threads > 0 ? config.threads : omp_get_max_threads();
+    int bits = 2;
+    while ((1 << bits) < threads * 4)
+        bits++;
+    int parts = 1 << bits;
+    nodes.clear();
+    vector<unique_ptr<VisitedTable>> visited;
+    for (int part = 0; part < parts; part++)
+        visited.emplace_back(new VisitedTable((config.memoryBudget / 4 << 20) / parts, nodes, stats.collisions));
+    size_t nodeBudget = (config.memoryBudget << 20) - (config.memoryBudget / 4 << 20);
+    State root = initState;
+    StateIdx rootIdx = nodes.push(root), ansIdx = NO_PARENT;
+    uint64_t rootKey = root.getKey();
+    visited[rootKey >> (64 - bits)]->insert(root, rootKey, rootIdx);
+    vector<StateIdx> layer{rootIdx};
+    vector<vector<vector<pair<uint64_t, State>>>> buffers(threads, vector<vector<pair<uint64_t, State>>>(parts));
+    vector<vector<StateIdx>> fresh(parts);
+    atomic<bool> full(false);
+
+    while (!layer.empty() && ansIdx == NO_PARENT && !full && !cancelled()) {
+        atomic<size_t> buffered(0);
+        atomic<bool> stop(false);
+#pragma omp parallel num_threads(threads)
+        {
+            ctx = &context;
+            auto& out = buffers[omp_get_thread_num()];
+            Expansion expansion;
+            expansion.deadRules = config.deadRules;
+            expansion.macros = config.macros;
+            expansion.pushBound = config.pushBound;
+            size_t expanded = 0, generated = 0;
+#pragma omp for schedule(dynamic, 64)
+            for (size_t i = 0; i < layer.size(); i++) {
+                // A cancelled layer is abandoned, the remaining iterations just fall through
+                if (stop.load(memory_order_relaxed))
+                    continue;
+                if (cancelled()) {
+                    stop.store(true);
+                    continue;
+                }
+                // Published in batches, config.nodeLimit is checked against the total
+                if (++expanded % 64 == 0)
+                    stats.expanded += 64;
+                for (auto const& nxtState : nodes[layer[i]].nextStates(layer[i], expansion)) {
+                    uint64_t key = nxtState.getKey();
+                    out[key >> (64 - bits)].emplace_back(key, nxtState);
+                    generated++;
+                }
+            }
+            stats.expanded += expanded % 64;
+            stats.generated += generated;
+            buffered += generated;
+            for (int rule = 0; rule < DEAD_RULES; rule++)
+                stats.prunes[rule] += expansion.prunes[rule];
+        }
+        if (stop)
+            break;
+        if (nodes.bytes() + buffered * sizeof(State) > nodeBudget) {
+            full = true;
+            break;
+        }
+#pragma omp parallel num_threads(threads)
+        {
+            ctx = &context;
+            int tid = omp_get_thread_num();
+            size_t dedupHits = 0;
+#pragma omp for schedule(dynamic, 1)
+            for (int part = 0; part < parts; part++) {
+                fresh[part].clear();
+                for (auto& out : buffers) {
+                    for (auto const& [key, nxtState] : out[part]) {
+                        StateIdx nxtIdx = nodes.push(nxtState, tid);
+                        auto res = visited[part]->insert(nxtState, key, nxtIdx);
+                        if (res == VisitedTable::INSERTED) {
+                            fresh[part].emplace_back(nxtIdx);
+                            if (nxtState.solved()) {
+#pragma omp critical
+                                if (ansIdx == NO_PARENT)
+                                    ansIdx = nxtIdx;
+                            }
+                        } else {
+                            nodes.pop(nxtIdx, tid);
+                            if (res == VisitedTable::DUPLICATE)
+                                dedupHits++;
+                            else
+                                full = true;
+                        }
+                    }
+                    out[part].clear();
+                }
+            }
+            stats.dedupHits += dedupHits;
+        }
+        layer.clear();
+        for (auto const& part : fresh)
+            layer.insert(layer.end(), part.begin(), part.end());
+    }
+    if (ansIdx == NO_PARENT) {
+        overflow = full;
+        if (!full && !cancelled() && config.pushBound == INT_MAX)
+            cerr << "No solution.\n";
+        return "";
+    }
+    found = true;
+    return getMoveSequence(nodes, ansIdx);
+}
+Sokoban::Record Sokoban::pack(State const& state) {
+    Record rec{};
+    copy(state.getBoxes().begin(), state.getBoxes().begin() + ctx->Boxes, rec.begin());
+    rec[ctx->Boxes] = to1D(state.getPos());
+    return rec;
+}
+Sokoban::State Sokoban::unpack(Record const& rec) {
+    bs256 boxMap;
+    for (int i = 0; i < ctx->Boxes; i++)
+        boxMap[rec[i]] = 1;
+    return State(to2D(rec[ctx->Boxes]), boxMap);
+}
+string Sokoban::external_bfs() {
+    // Breadth-first by transitions with delayed duplicate detection: children of
+    // a layer are buffered up to the memory budget and spilled as sorted runs,
+    // then the runs are merged against the sorted file of every visited state.
+    // Only the layers are kept, the solution is traced back through them.
+    if (initState.solved()) {
+        found = true;
+        return "";
+    }
+    static atomic<int> spills(0);
+    filesystem::path dir = config.spillDir.empty() ? filesystem::temp_directory_path() : filesystem::path(config.spillDir);
+    dir /= "sokoban-" + to_string(getpid()) + "-" + to_string(spills++);
+    error_code ec;
+    filesystem::create_directories(dir, ec);
+    if (ec) {
+        cerr << "Cannot create " << dir << ".\n";
+        return "";
+    }
+    struct Cleanup {
+        filesystem::path dir;
+        ~Cleanup() {
+            error_code ec;
+            filesystem::remove_all(dir, ec);
+        }
+    } cleanup{dir};
+    auto layerPath = [&](int k) { return dir / ("layer" + to_string(k)); };
+    auto visitedPath = [&](int k) { return dir / ("visited" + to_string(k)); };
+    size_t width = ctx->Boxes + 1;
+    auto read = [&](ifstream& in, Record& rec) { return (bool)in.read(reinterpret_cast<char*>(rec.data()), width); };
+    auto write = [&](ofstream& out, Record const& rec) { out.write(reinterpret_cast<char const*>(rec.data()), width); };
+
+    int threads = config.threads > 0 ? config.threads : omp_get_max_threads();
+    size_t capacity = max<size_t>((config.memoryBudget << 20) / 2 / sizeof(Record), 1024);
+    const size_t BLOCK = 1 << 14;
+    Record root = pack(initState);
+    ofstream(layerPath(0), ios::binary).write(reinterpret_cast<char const*>(root.data()), width);
+    ofstream(visitedPath(0), ios::binary).write(reinterpret_cast<char const*>(root.data()), width);
+    int depth = 0;
+    bool solved = false;
+    State goal;
+    vector<Record> buffer;
+    while (!solved && !cancelled()) {
+        // Expand layer depth in blocks, spilling the children in sorted runs
+        vector<filesystem::path> runs;
+        auto spill = [&]() {
+            sort(buffer.begin(), buffer.end());
+            buffer.erase(unique(buffer.begin(), buffer.end()), buffer.end());
+            runs.emplace_back(dir / ("run" + to_string(runs.size())));
+            ofstream out(runs.back(), ios::binary);
+            for (auto const& rec : buffer)
+                write(out, rec);
+            buffer.clear();
+        };
+        ifstream layer(layerPath(depth), ios::binary);
+        vector<Record> block;
+        for (Record rec; !solved && !cancelled();) {
+            block.clear();
+            while (block.size() < BLOCK && read(layer, rec))
+                block.emplace_back(rec);
+            if (block.empty())
+                break;
+            atomic<bool> stop(false);
+#pragma omp parallel num_threads(threads)
+            {
+                ctx = &context;
+                Expansion expansion;
+                expansion.deadRules = config.deadRules;
+                expansion.macros = config.macros;
+                vector<Record> children;
+                size_t expanded = 0, generated = 0;
+#pragma omp for schedule(dynamic, 64)
+                for (size_t i = 0; i < block.size(); i++) {
+                    // A cancelled block is abandoned, the remaining iterations just fall through
+                    if (stop.load(memory_order_relaxed))
+                        continue;
+                    if (cancelled()) {
+                        stop.store(true);
+                        continue;
+                    }
+                    // Published in batches, config.nodeLimit is checked against the total
+                    if (++expanded % 64 == 0)
+                        stats.expanded += 64;
+                    for (auto const& nxtState : unpack(block[i]).nextStates(NO_PARENT, expansion)) {
+                        if (nxtState.solved()) {
+#pragma omp critical
+                            if (!solved) {
+                                solved = true;
+                                goal = nxtState;
+                            }
+                        }
+                        children.emplace_back(pack(nxtState));
+                        generated++;
+                    }
+                }
+                stats.expanded += expanded % 64;
+                stats.generated += generated;
+                for (int rule = 0; rule < DEAD_RULES; rule++)
+                    stats.prunes[rule] += expansion.prunes[rule];
+#pragma omp critical
+                buffer.insert(buffer.end(), children.begin(), children.end());
+            }
+            if (buffer.size() >= capacity)
+                spill();
+        }
+        if (solved || cancelled())
+            break;
+        spill();
+
+        // Merge the runs, dropping states already in the visited file
+        ifstream visited(visitedPath(depth), ios::binary);
+        ofstream nxtLayer(layerPath(depth + 1), ios::binary), nxtVisited(visitedPath(depth + 1), ios::binary);
+        vector<ifstream> ins;
+        priority_queue<pair<Record, size_t>, vector<pair<Record, size_t>>, greater<pair<Record, size_t>>> heap;
+        for (auto const& run : runs) {
+            ins.emplace_back(run, ios::binary);
+            Record rec{};
+            if (read(ins.back(), rec))
+                heap.emplace(rec, ins.size() - 1);
+        }
+        Record seen{}, last{};
+        bool hasSeen = read(visited, seen), hasLast = false;
+        size_t added = 0;
+        while (!heap.empty()) {
+            auto [rec, run] = heap.top();
+            heap.pop();
+            Record nxt{};
+            if (read(ins[run], nxt))
+                heap.emplace(nxt, run);
+            if (hasLast && rec == last)
+                continue;
+            last = rec;
+            hasLast = true;
+            for (; hasSeen && seen < rec; hasSeen = read(visited, seen))
+                write(nxtVisited, seen);
+            if (hasSeen && seen == rec) {
+                stats.dedupHits++;
+                continue;
+            }
+            write(nxtLayer, rec);
+            write(nxtVisited, rec);
+            added++;
+        }
+        for (; hasSeen; hasSeen = read(visited, seen))
+            write(nxtVisited, seen);
+        visited.close();
+        ins.clear();
+        for (auto const& run : runs)
+            filesystem::remove(run, ec);
+        filesystem::remove(visitedPath(depth), ec);
+        if (!nxtLayer || !nxtVisited) {
+            cerr << "Cannot write to " << dir << ".\n";
+            return "";
+        }
+        depth++;
+        if (added == 0) {
+            cerr << "No solution.\n";
+            return "";
+        }
+    }
+
+    if (!solved)
+        return "";
+
+    // Walk back through the layers for a parent of every state on the path
+    vector<State> path{goal};
+    Expansion expansion;
+    expansion.deadRules = config.deadRules;
+    expansion.macros = config.macros;
+    for (int k = depth; k >= 0; k--) {
+        ifstream layer(layerPath(k), ios::binary);
+        bool linked = false;
+        for (Record rec{}; !linked && read(layer, rec);) {
+            State prvState = unpack(rec);
+            for (auto const& nxtState : prvState.nextStates(NO_PARENT, expansion)) {
+                if (nxtState == path.back()) {
+                    path.emplace_back(prvState);
+                    linked = true;
+                    break;
+                }
+            }
+        }
+    }
+    reverse(path.begin(), path.end());
+    found = true;
+    return getMoveSequence(nodes, relink(path, expansion));
+}
+StateIdx Sokoban::relink(vector<State> const& path, Expansion& expansion) {
+    // Rebuild the parent chain of a root-to-goal path in the arena, so that
+    // getMoveSequence() can replay the pushes between its states
+    nodes.clear();
+    StateIdx idx = nodes.push(path[0]);
+    for (size_t i = 1; i < path.size(); i++) {
+        for (auto const& nxtState : nodes[idx].nextStates(idx, expansion)) {
+            if (nxtState == path[i]) {
+                idx = nodes.push(nxtState);
+                break;
+            }
+        }
+    }
+    return idx;
+}
+Sokoban::TransTable::TransTable(size_t bytes) {
+    size_t capacity = 1024;
+    while (capacity * 2 * sizeof(Slot) <= bytes) capacity *= 2;
+    slots = static_cast<Slot*>(calloc(capacity, sizeof(Slot)));
+    if (!slots) {
+        cerr << "Cannot allocate transposition table.\n";
+        exit(1);
+    }
+    mask = capacity - 1;
+}
+Sokoban::TransTable::~TransTable() {
+    free(slots);
+}
+bool Sokoban::TransTable::visit(uint64_t const& key, int const& iteration, int const& pushes) {
+    uint64_t iter = (uint64_t)iteration + 1;
+    uint64_t meta = iter << 32 | (uint32_t)pushes;
+    size_t bucket = key & mask & ~(size_t)1, victim = bucket;
+    uint64_t victimRank = UINT64_MAX;
+    for (size_t i = bucket; i < bucket + 2; i++) {
+        uint64_t curMeta = slots[i].meta.load(memory_order_relaxed);
+        uint64_t curCheck = slots[i].check.load(memory_order_relaxed);
+        if (curMeta != 0 && (curCheck ^ curMeta) == key) {
+            if ((curMeta >> 32) == iter && (uint32_t)curMeta <= (uint32_t)pushes)
+                return true;
+            victim = i;
+            break;
+        }
+        // Rank the slots for replacement: empty ones first, then other iterations, then the deepest
+        uint64_t rank = curMeta == 0 ? 0 : (curMeta >> 32) != iter ? 1 : 2 + (UINT32_MAX - (uint32_t)curMeta);
+        if (rank < victimRank) {
+            victimRank = rank;
+            victim = i;
+        }
+    }
+    slots[victim].meta.store(meta, memory_order_relaxed);
+    slots[victim].check.store(key ^ meta, memory_order_relaxed);
+    return false;
+}
+bool Sokoban::idaSearch(IdaThread& thread, TransTable& table, atomic<int>& next, atomic<bool> const& done) {
+    State state = thread.path.back();
+    int f = state.getCost(ASTAR);
+    if (f > thread.bound) {
+        for (int cur = next.load(); f < cur && !next.compare_exchange_weak(cur, f);) {}
+        return false;
+    }
+    if (state.solved())
+        return true;
+    if (done.load(memory_order_relaxed) || cancelled() || table.visit(state.getKey(), thread.iteration, state.getPushes()))
+        return false;
+    auto nextStates = state.nextStates(NO_PARENT, thread.expansion);
+    // Published in batches, config.nodeLimit is checked against the total
+    if (++thread.expanded % 64 == 0)
+        stats.expanded += 64;
+    thread.generated += nextStates.size();
+    stable_sort(nextStates.begin(), nextStates.end(), [](State const& lhs, State const& rhs) {
+        return lhs.getCost(ASTAR) < rhs.getCost(ASTAR);
+    });
+    for (auto const& nxtState : nextStates) {
+        thread.path.emplace_back(nxtState);
+        if (idaSearch(thread, table, next, done))
+            return true;
+        thread.path.pop_back();
+    }
+    return false;
+}
+string Sokoban::ida() {
+    // Iterative deepening on pushes + heuristic, keeping only the current paths
+    // and a fixed-size table. The tree is split once into the distinct states
+    // of its first few levels, which threads pick up one by one per iteration.
+    int threads = config.threads > 0 ? config.threads : omp_get_max_threads();
+    Heuristic heuristic(config.heuristic);
+    Expansion expansion;
+    expansion.heuristic = &heuristic;
+    expansion.deadRules = config.deadRules;
+    expansion.macros = config.macros;
+    State root = initState;
+    root.setHeuristic(heuristic.load(root));
+    vector<vector<State>> tops{{root}};
+    vector<State> const* answer = nullptr;
+    if (root.solved())
+        answer = &tops[0];
+    unordered_set<uint64_t> seen{root.getKey()};
+    while (!answer && threads > 1 && tops.size() < (size_t)threads * 8) {
+        vector<vector<State>> deeper;
+        for (auto const& path : tops) {
+            for (auto const& nxtState : path.back().nextStates(NO_PARENT, expansion)) {
+                if (!seen.insert(nxtState.getKey()).second)
+                    continue;
+                deeper.emplace_back(path);
+                deeper.back().emplace_back(nxtState);
+            }
+        }
+        if (deeper.empty())
+            break;
+        tops.swap(deeper);
+        for (auto const& path : tops) {
+            if (path.back().solved())
+                answer = &path;
+        }
+    }
+
+    TransTable table(config.memoryBudget / 4 << 20);
+    vector<State> solution;
+    atomic<bool> done(false);
+    for (int bound = root.getCost(ASTAR), iteration = 0; !answer && !done && !cancelled() && bound < DIST_INF; iteration++) {
+        atomic<int> next(DIST_INF);
+#pragma omp parallel num_threads(threads)
+        {
+            ctx = &context;
+            IdaThread thread;
+            Heuristic heuristic(config.heuristic);
+            thread.bound = bound;
+            thread.iteration = iteration;
+            thread.expansion.heuristic = &heuristic;
+            thread.expansion.deadRules = config.deadRules;
+            thread.expansion.macros = config.macros;
+#pragma omp for schedule(dynamic, 1)
+            for (size_t i = 0; i < tops.size(); i++) {
+                if (done.load(memory_order_relaxed))
+                    continue;
+                thread.path = tops[i];
+                if (idaSearch(thread, table, next, done)) {
+#pragma omp critical
+                    if (!done) {
+                        solution = thread.path;
+                        done = true;
+                    }
+                }
+            }
+            stats.expanded += thread.expanded % 64;
+            stats.generated += thread.generated;
+            for (int rule = 0; rule < DEAD_RULES; rule++)
+                stats.prunes[rule] += thread.expansion.prunes[rule];
+        }
+        bound = next;
+    }
+    if (done)
+        answer = &solution;
+    if (!answer) {
+        if (!cancelled())
+            cerr << "No solution.\n";
+        return "";
+    }
+    found = true;
+    return getMoveSequence(nodes, relink(*answer, expansion));
+}
+string Sokoban::portfolio() {
+    // Race differently configured searches of the same level, each on its own
+    // share of the threads and memory. The first to solve it cancels the rest.
+    struct Strategy {
+        char const* name;
+        Search search;
+        Order order;
+        Matching heuristic;
+        unsigned deadRules;
+    };
+    const Strategy strategies[] = {
+        {"filled", PARALLEL, FILLED, config.heuristic, config.deadRules},
+        {"astar", PARALLEL, ASTAR, HUNGARIAN, config.deadRules},
+        {"best", PARALLEL, BEST, GREEDY, config.deadRules},
+        {"bidir", BIDIR, FILLED, config.heuristic, config.deadRules},
+        {"learned", PARALLEL, FILLED, config.heuristic, config.deadRules | 1u << DEAD_LEARNED},
+        {"ida", IDA, ASTAR, HUNGARIAN, config.deadRules},
+        {"layered", LAYERED, FILLED, config.heuristic, config.deadRules},
+    };
+    vector<Strategy> racers;
+    string names = config.portfolio + ",";
+    for (size_t beg = 0, end; (end = names.find(',', beg)) != string::npos; beg = end + 1) {
+        for (auto const& strategy : strategies) {
+            if (names.substr(beg, end - beg) == strategy.name)
+                racers.emplace_back(strategy);
+        }
+    }
+    if (racers.empty()) {
+        cerr << "No known strategy in " << config.portfolio << ".\n";
+        return "";
+    }
+
+    int threads = config.threads > 0 ? config.threads : omp_get_max_threads();
+    atomic<bool> cancel(false);
+    bool learning = false;
+    int winner = -1;
+    string moves;
+    vector<thread> running;
+    for (size_t k = 0; k < racers.size(); k++) {
+        Config racer = config;
+        racer.search = racers[k].search;
+        racer.order = racers[k].order;
+        racer.heuristic = racers[k].heuristic;
+        racer.deadRules = racers[k].deadRules;
+        racer.threads = max<int>(1, threads / racers.size());
+        racer.memoryBudget = max<size_t>(config.memoryBudget / racers.size(), 16);
+        if (config.nodeLimit)
+            racer.nodeLimit = max<size_t>(config.nodeLimit / racers.size(), 1);
+        racer.cancel = &cancel;
+        // Learners would share one file of learned deadlocks, the first keeps it
+        if (!(racer.deadRules & (1u << DEAD_LEARNED)) || exchange(learning, true))
+            racer.learnDir.clear();
+        running.emplace_back([&, k, racer]() {
+            Sokoban sokoban(racer);
+            if (!sokoban.load(level))
+                return;
+            string res = sokoban.solve();
+            stats += sokoban.getStats();
+            if (sokoban.foundSolution() && !cancel.exchange(true)) {
+                winner = k;
+                moves = res;
+            }
+        });
+    }
+    for (auto& racer : running)
+        racer.join();
+    ctx = &context;
+    if (winner < 0)
+        return "";
+    cerr << "Solved by " << racers[winner].name << ".\n";
+    found = true;
+    return moves;
+}
+string Sokoban::anytime() {
+    // A quick greedy solution first, then A* passes that drop every child which
+    // cannot finish in fewer pushes than the best so far. Each solution found
+    // tightens the bound; the best one is returned once a pass runs dry or the
+    // time or node limit is reached.
+    string best;
+    int bestPushes = INT_MAX;
+    bool solved = false;
+    while (!cancelled() && bestPushes > 0) {
+        Config pass = config;
+        pass.search = PARALLEL;
+        pass.order = solved ? ASTAR : BEST;
+        pass.pushBound = bestPushes;
+        if (config.timeLimit > 0) {
+            // Time may have run out since cancelled(), and no timeLimit would mean none
+            pass.timeLimit = chrono::duration<double>(deadline - chrono::steady_clock::now()).count();
+            if (pass.timeLimit <= 0)
+                break;
+        }
+        if (config.nodeLimit)
+            pass.nodeLimit = config.nodeLimit - (stats.expanded - nodeStart);
+        Sokoban sokoban(pass);
+        if (!sokoban.load(level))
+            break;
+        string moves = sokoban.solve();
+        stats += sokoban.getStats();
+        ctx = &context;
+        if (!sokoban.foundSolution())
+            break;
+        best = moves;
+        bestPushes = countPushes(moves);
+        solved = true;
+        cerr << "Solution of " << bestPushes << " pushes, " << moves.size() << " moves.\n";
+    }
+    ctx = &context;
+    found = solved;
+    return best;
+}
+bool Sokoban::cancelled() const {
+    return (config.cancel && config.cancel->load(memory_order_relaxed)) || outOfBudget();
+}
+bool Sokoban::outOfBudget() const {
+    return (config.nodeLimit && stats.expanded - nodeStart >= config.nodeLimit) ||
+           (config.timeLimit > 0 && chrono::steady_clock::now() >= deadline);
+}
+Sokoban::Stats const& Sokoban::getStats() const {
+    return this->stats;
+}
+Sokoban::Stats& Sokoban::Stats::operator+=(Stats const& rhs) {
+    expanded += rhs.expanded;
+    generated += rhs.generated;
+    dedupHits += rhs.dedupHits;
+    collisions += rhs.collisions;
+    for (int rule = 0; rule < DEAD_RULES; rule++)
+        prunes[rule] += rhs.prunes[rule];
+    return *this;
+}
+bool Sokoban::foundSolution() const {
+    return this->found;
+}
+void report(Sokoban::Stats const& stats) {
+    cerr << "expanded: " << stats.expanded << ", generated: " << stats.generated
+         << ", dedup hits: " << stats.dedupHits << ", hash collisions: " << stats.collisions << "\n";
+    cerr << "pruned:";
+    for (int rule = DEAD_SQUARE; rule < DEAD_RULES; rule++)
+        cerr << " " << deadRuleNames[rule] << "=" << stats.prunes[rule];
+    cerr << "\n";
+}
+
+// =================Batch======================
+// Next level of a stream: rows up to a blank line, ';' lines before them name it
+bool readLevel(istream& in, string& name, vector<string>& rows) {
+    string line;
+    name.clear();
+    rows.clear();
+    while (getline(in, line)) {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (line.find_first_not_of(" \t") == string::npos) {
+            if (!rows.empty())
+                return true;
+        } else if (line[0] == ';') {
+            if (rows.empty())
+                name = line.substr(line.find_first_not_of("; \t"));
+        } else {
+            rows.emplace_back(line);
+        }
+    }
+    return !rows.empty();
+}
+// Solves every level of a directory, or of a stream on stdin when dir is "-".
+// Each thread of one OpenMP team takes levels in turn and solves them on its
+// own warm Sokoban, single-threaded at first; threads that run out of levels
+// join the solves still growing through the ThreadBudget. Prints one
+// "name<TAB>moves" line per level in input order, "-" for an unsolved one.
+int batch(Sokoban::Config const& config, string const& dir, bool verbose) {
+    int threads = config.threads > 0 ? config.threads : omp_get_max_threads();
+    vector<string> files;
+    if (dir != "-") {
+        for (auto const& entry : filesystem::directory_iterator(dir)) {
+            if (entry.is_regular_file())
+                files.emplace_back(entry.path().string());
+        }
+        sort(files.begin(), files.end());
+    }
+    ThreadBudget budget;
+    mutex lock;
+    vector<string> results;
+    vector<bool> ready;
+    size_t printed = 0;
+    int failed = 0;
+    Sokoban::Stats total;
+    // Up to one solve per thread at once, -m is split between them
+    Sokoban::Config share = config;
+    share.memoryBudget = max<size_t>(config.memoryBudget / threads, 16);
+
+#pragma omp parallel num_threads(threads)
+    {
+        Sokoban sokoban(share, &budget);
+        while (true) {
+            size_t i;
+            string name;
+            vector<string> rows;
+            {
+                lock_guard<mutex> guard(lock);
+                i = results.size();
+                if (dir == "-") {
+                    if (!readLevel(cin, name, rows))
+                        break;
+                    if (name.empty())
+                        name = to_string(i + 1);
+                } else {
+                    if (i == files.size())
+                        break;
+                    name = filesystem::path(files[i]).filename().string();
+                }
+                results.emplace_back();
+                ready.emplace_back(false);
+            }
+            bool loaded = dir == "-" ? sokoban.load(rows) : sokoban.getInput(files[i].c_str());
+            string moves = loaded ? sokoban.solve() : "";
+            bool ok = loaded && sokoban.foundSolution();
+            lock_guard<mutex> guard(lock);
+            failed += !ok;
+            results[i] = name + "\t" + (ok ? moves : "-");
+            ready[i] = true;
+            for (; printed < ready.size() && ready[printed]; printed++)
+                cout << results[printed] << endl;
+        }
+        {
+            lock_guard<mutex> guard(lock);
+            total += sokoban.getStats();
+        }
+        budget.release();
+    }
+    if (verbose)
+        report(total);
+    return failed ? 2 : 0;
+}
+
+// =================Benchmark==================
+// Replays moves with the same rules as try_move() in example_solver.py
+bool validate(char const* file_path, string const& moves) {
+    ifstream input_file(file_path);
+    vector<string> m;
+    string line;
+    int y = -1, x = -1;
+    while (getline(input_file, line)) {
+        size_t p = line.find_first_of("oO!");
+        if (p != string::npos)
+            y = m.size(), x = p;
+        m.emplace_back(line);
+    }
+    if (y < 0)
+        return false;
+    for (char key : moves) {
+        int dy = key == 'W' ? -1 : key == 'S' ? 1 : 0;
+        int dx = key == 'A' ? -1 : key == 'D' ? 1 : 0;
+        if (dy == 0 && dx == 0)
+            return false;
+        char& nxt = m[y + dy][x + dx];
+        if (nxt == EMPTY || nxt == TARGET || nxt == FRAGILE) {
+            nxt = addPly(nxt);
+        } else if ((nxt == BOX || nxt == BOXT) && (m[y + 2 * dy][x + 2 * dx] == EMPTY || m[y + 2 * dy][x + 2 * dx] == TARGET)) {
+            m[y + 2 * dy][x + 2 * dx] = addBox(m[y + 2 * dy][x + 2 * dx]);
+            nxt = addPly(rmBox(nxt));
+        } else {
+            return false;
+        }
+        m[y][x] = rmPly(m[y][x]);
+        y += dy, x += dx;
+    }
+    for (auto const& row : m) {
+        if (row.find(BOX) != string::npos)
+            return false;
+    }
+    return true;
+}
+// Peak resident set size in KB since the last call with reset
+long peakRss(bool reset) {
+    if (reset) {
+        // Writing 5 to clear_refs resets VmHWM on Linux
+        ofstream("/proc/self/clear_refs") << "5";
+        return 0;
+    }
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line)) {
+        if (line.compare(0, 6, "VmHWM:") == 0)
+            return atol(line.c_str() + 6);
+    }
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+int bench(Sokoban::Config const& config, string const& dir, int runs, bool csv) {
+    vector<string> levels;
+    for (auto const& entry : filesystem::directory_iterator(dir)) {
+        if (entry.is_regular_file())
+            levels.emplace_back(entry.path().string());
+    }
+    sort(levels.begin(), levels.end());
+
+    bool allOk = true;
+    if (csv)
+        cout << "level,run,ok,time_ms,expanded,generated,dedup_hits,peak_rss_kb,moves\n";
+    else
+        cout << "[";
+    bool first = true;
+    for (auto const& level : levels) {
+        for (int run = 1; run <= runs; run++) {
+            peakRss(true);
+            auto start = chrono::steady_clock::now();
+            Sokoban sokoban(config);
+            string moves;
+            if (sokoban.getInput(level.c_str()))
+                moves = sokoban.solve();
+            double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+            bool ok = validate(level.c_str(), moves);
+            auto const& stats = sokoban.getStats();
+            string name = filesystem::path(level).filename().string();
+            allOk &= ok;
+            if (csv) {
+                cout << name << "," << run << "," << ok << "," << ms << "," << stats.expanded << "," << stats.generated
+                     << "," << stats.dedupHits << "," << peakRss(false) << "," << moves.size() << "\n";
+            } else {
+                cout << (first ? "\n" : ",\n") << "  {\"level\": \"" << name << "\", \"run\": " << run
+                     << ", \"ok\": " << (ok ? "true" : "false") << ", \"time_ms\": " << ms
+                     << ", \"expanded\": " << stats.expanded << ", \"generated\": " << stats.generated
+                     << ", \"dedup_hits\": " << stats.dedupHits << ", \"peak_rss_kb\": " << peakRss(false)
+                     << ", \"moves\": " << moves.size() << "}";
+            }
+            cout.flush();
+            first = false;
+        }
+    }
+    if (!csv)
+        cout << "\n]\n";
+    return allOk ? 0 : 2;
+}
+
+int main(int argc, char* argv[]) {
+    const option longOptions[] = {
+        {"search", required_argument, nullptr, 's'},
+        {"order", required_argument, nullptr, 'o'},
+        {"heuristic", required_argument, nullptr, 'H'},
+        {"rules", required_argument, nullptr, 'r'},
+        {"macros", required_argument, nullptr, 'M'},
+        {"bench", optional_argument, nullptr, 'b'},
+        {"format", required_argument, nullptr, 'f'},
+        {"batch", no_argument, nullptr, 'B'},
+        {"spill", required_argument, nullptr, 'S'},
+        {"profile", optional_argument, nullptr, 'P'},
+        {"learn", required_argument, nullptr, 'L'},
+        {"cache", required_argument, nullptr, 'C'},
+        {"time", required_argument, nullptr, 'T'},
+        {"nodes", required_argument, nullptr, 'N'},
+        {"portfolio", required_argument, nullptr, 'p'},
+        {nullptr, 0, nullptr, 0}};
+    const char* usage = " [-m budget_mb] [-t threads] [-v] [--search=parallel|serial|bidir|external|ida|portfolio|anytime|layered] [--time=seconds] [--nodes=expanded] [--portfolio=filled,astar,best,bidir,learned,ida,layered] [--spill=dir] [--order=filled|astar|best] [--heuristic=greedy|hungarian]"
+                        " [--rules=square,block,pattern,freeze,bipartite,learned] [--learn=dir] [--cache=dir] [--macros=tunnel,room|none]"
+                        " [--bench[=runs] [--format=json|csv]] [--batch] [--profile[=json]] file|dir|-\n";
+    Sokoban::Config config;
+    bool verbose = false;
+    int benchRuns = 0;
+    bool batchMode = false;
+    bool csv = false;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "m:t:v", longOptions, nullptr)) != -1) {
+        switch (opt) {
+            case 'm':
+                config.memoryBudget = atol(optarg);
+                break;
+            case 't':
+                config.threads = atoi(optarg);
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            case 's':
+                if (string(optarg) == "serial")
+                    config.search = SERIAL;
+                else if (string(optarg) == "bidir")
+                    config.search = BIDIR;
+                else if (string(optarg) == "external")
+                    config.search = EXTERNAL;
+                else if (string(optarg) == "ida")
+                    config.search = IDA;
+                else if (string(optarg) == "portfolio")
+                    config.search = PORTFOLIO;
+                else if (string(optarg) == "anytime")
+                    config.search = ANYTIME;
+                else if (string(optarg) == "layered")
+                    config.search = LAYERED;
+                else
+                    config.search = PARALLEL;
+                break;
+            case 'o':
+                if (string(optarg) == "astar")
+                    config.order = ASTAR;
+                else if (string(optarg) == "best")
+                    config.order = BEST;
+                else
+                    config.order = FILLED;
+                break;
+            case 'H':
+                config.heuristic = string(optarg) == "greedy" ? GREEDY : HUNGARIAN;
+                break;
+            case 'b':
+                benchRuns = optarg ? atoi(optarg) : 1;
+                break;
+            case 'f':
+                csv = string(optarg) == "csv";
+                break;
+            case 'B':
+                batchMode = true;
+                break;
+            case 'S':
+                config.spillDir = optarg;
+                break;
+            case 'p':
+                config.portfolio = optarg;
+                config.search = PORTFOLIO;
+                break;
+            case 'L':
+                config.learnDir = optarg;
+                config.deadRules |= 1u << DEAD_LEARNED;
+                break;
+            case 'C':
+                config.cacheDir = optarg;
+                break;
+            case 'T':
+                config.timeLimit = atof(optarg);
+                break;
+            case 'N':
+                config.nodeLimit = atol(optarg);
+                break;
+            case 'P':
+                if (!PROFILE) {
+                    cerr << "Built without instrumentation, rebuild with -DPROFILE=1.\n";
+                    break;
+                }
+                profilePath = optarg ? optarg : "";
+                atexit(dumpProfile);
+                break;
+            case 'r': {
+                config.deadRules = 0;
+                string rules = string(optarg) + ",";
+                for (size_t beg = 0, end; (end = rules.find(',', beg)) != string::npos; beg = end + 1) {
+                    for (int rule = DEAD_SQUARE; rule < DEAD_RULES; rule++) {
+                        if (rules.substr(beg, end - beg) == deadRuleNames[rule])
+                            config.deadRules |= 1u << rule;
+                    }
+                }
+                break;
+            }
+            case 'M': {
+                config.macros = 0;
+                string macros = string(optarg) + ",";
+                for (size_t beg = 0, end; (end = macros.find(',', beg)) != string::npos; beg = end + 1) {
+                    if (macros.substr(beg, end - beg) == "tunnel")
+                        config.macros |= MACRO_TUNNEL;
+                    else if (macros.substr(beg, end - beg) == "room")
+                        config.macros |= MACRO_ROOM;
+                }
+                break;
+            }
+            default:
+                cerr << "Usage: " << argv[0] << usage;
+                return 1;
+        }
+    }
+    if (benchRuns > 0)
+        return bench(config, optind < argc ? argv[optind] : "samples", benchRuns, csv);
+    if (batchMode)
+        return batch(config, optind < argc ? argv[optind] : "-", verbose);
+    if (optind != argc - 1)
         cerr << "Input Error...\n";
-    srand(time(NULL));
-    Sokoban sokoban;
-    sokoban.getInput(argv[1]);
-    cout << sokoban.parallel_bfs() << "\n";
+    Sokoban sokoban(config);
+    if (!sokoban.getInput(argv[optind]))
+        return 1;
+    cout << sokoban.solve() << "\n";
+    if (!sokoban.foundSolution() && sokoban.outOfBudget())
+        cerr << "Search limit reached.\n";
+    if (verbose)
+        report(sokoban.getStats());
     return 0;
 }
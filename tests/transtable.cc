@@ -0,0 +1,43 @@
+// Checks of the IDA* transposition table, built and run by `make check`
+#define main hw1Main
+#include "../hw1.cc"
+#undef main
+
+int failures = 0;
+
+void expect(bool ok, char const* what) {
+    if (!ok) {
+        cerr << "FAIL: " << what << "\n";
+        failures++;
+    }
+}
+
+int main() {
+    // Three keys of bucket 2; a and c share the upper half that a tag would keep
+    const uint64_t a = 1ULL << 32 | 2, b = 2ULL << 32 | 3, c = 1ULL << 32 | 3;
+    {
+        Sokoban::TransTable table(0);
+        expect(!table.visit(a, 0, 5), "a is new");
+        expect(!table.visit(b, 0, 7), "b is new");
+        expect(table.visit(a, 0, 5), "a kept in the first slot of the bucket");
+        expect(table.visit(b, 0, 7), "b kept in the second slot of the bucket");
+        expect(table.visit(a, 0, 6), "a entered again deeper is pruned");
+        expect(!table.visit(a, 0, 4), "a entered again shallower is searched");
+        expect(table.visit(a, 0, 4), "a keeps the shallower entry");
+        expect(!table.visit(c, 0, 9), "c is not a although their tags match");
+        expect(table.visit(a, 0, 4), "c replaced the deeper b, not a");
+        expect(!table.visit(b, 0, 7), "b was replaced");
+    }
+    {
+        Sokoban::TransTable table(0);
+        expect(!table.visit(a, 0, 5), "a is new");
+        expect(!table.visit(a, 1, 5), "a is searched again in the next iteration");
+        expect(!table.visit(b, 1, 8), "b is new");
+        expect(table.visit(a, 1, 5), "a of this iteration kept");
+        expect(table.visit(b, 1, 8), "b took the empty slot");
+    }
+    if (failures)
+        return 1;
+    cerr << "transtable: ok\n";
+    return 0;
+}